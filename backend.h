@@ -0,0 +1,41 @@
+/* Controllers as backends of ctrl_multi
+ *
+ * Copyright (C) 2015 Marcus Menzel <codingmax@gmx-topmail.de>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ * 
+ * http://www.gnu.org/licenses/gpl-2.0.html
+ */
+ 
+#ifndef _BACKEND_H_
+#define _BACKEND_H_
+
+/* A controller built with -DCTRL_MULTI has no main() but a Backend. start()
+ * reads the options of the current scope (see push_opts()) and adds its
+ * sources to the event loop, free() releases what start() set up. */
+
+typedef struct Backend {
+	char *name;
+	char *optString;
+	int state;        /* writes button states, not single events */
+	int (*start)();
+	void (*free)();
+} Backend;
+
+extern Backend fifoBackend;
+extern Backend serialBackend;
+extern Backend usbmouseBackend;
+
+#endif
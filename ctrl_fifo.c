@@ -20,7 +20,7 @@
  * 
  * http://www.gnu.org/licenses/gpl-2.0.html
  */
-  
+#define _GNU_SOURCE
   
 #include <fcntl.h>   
 #include <stdio.h>
@@ -28,16 +28,79 @@
 #include <stdlib.h>
 #include <unistd.h>    
 #include <errno.h>
+#include <time.h>
+#include <limits.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
 
 #include "util.h"
+#include "backend.h"
 
 #define PROG "ctrl_fifo"
 #define RELEASE PROG " 0.0.1"
 
+/* bytes moved by one splice() call */
+#define SPLICE_SIZE (64*1024)
+
+/* bytes read at once from one of several fifos, the default pipe
+ * capacity, so a read gets all of the atomic writes in the fifo */
+#define CHUNK_SIZE (64*1024)
+#define PREFIXED_MAX 255     /* bytes after a prefix, their number fits a byte */
+
+#define FIFO_MAX 16
+
+/* default size of the stdout queue, some chunks */
+#define QUEUE_SIZE (256*1024)
+
+#define OPTIONS ":B:c:Chko:p:q:r:R:tx:"
+
+/* record of -r: the number of the fifo, then the bytes. Chunks longer
+ * than a record are split. */
+#define CAP_CHUNK 1
+
+/* the output of ctrl_multi is mapped, so it has to pass out_write() */
+#ifdef CTRL_MULTI
+#define CAN_SPLICE 0
+#else
+#define CAN_SPLICE 1
+#endif
+
+typedef struct Fifo {
+	int nr;
+	char *path;
+	char *dir;
+	char *name;
+	int priority;     /* served first if several fifos have data */
+	int prefix;       /* byte sent before every unit of this fifo, -1: none */
+	int fd;
+	int keepFd;       /* write end held open, so the reader never sees EOF */
+	int wd;           /* inotify watch of dir */
+} Fifo;
+
 typedef struct Settings {        
-	char *fifoPath;
 	int testmode;
+	int useSplice;    /* stdout is a pipe and splice() works */
+	char *replayPath;
+	int replaySpeed;
+
+	int persistent;   /* keep the fifos open, see attach_fifo() */
+	int inotifyFd;
+
+	/* collected in one round of the event loop, see end_of_round() */
+	int roundDeferred;
+	int readyNb;
+	Fifo *ready[FIFO_MAX];
+	int inotify;
+
+	char **items;     /* of option -p */
+	int fifoNb;
+	Fifo fifo[FIFO_MAX];
+
+	int statChunks;
+	int statBytes;
+	int statReattach;
 } Settings;
 
 static Settings *settings = NULL;
@@ -47,14 +110,33 @@ static void free_settings() {
 	
 	if (settings == NULL)
 		return;
+
+	int i;
+	for (i = 0; i < settings->fifoNb; i++) {
+		Fifo *f = &settings->fifo[i];
+		if (f->fd >= 0)
+			close(f->fd);
+		if (f->keepFd >= 0)
+			close(f->keepFd);
+		free(f->dir);
+	}
+
+	if (settings->inotifyFd >= 0)
+		close(settings->inotifyFd);
+
+	free(settings->items);
 	free(settings);
 	settings = NULL;
 }
 
+#ifndef CTRL_MULTI
 
 static void my_exit(int retVal) {
 	
 	free_settings();
+	cap_close();
+	loop_free();
+	free_output();
 	info("Exit.");
 	exit(retVal);
 }
@@ -72,10 +154,96 @@ static void print_info() {
     printf("  -h              help (this info)\n");
     printf("  -p <path>       path of the fifo (e.g. '/tmp/l4l_fifo')\n");
     printf("                  NOT optional\n");
+    printf("                  Up to %d fifos may be given comma separated, each\n", FIFO_MAX);
+    printf("                  as <path>[:<priority>[:<prefix>]], e.g.\n");
+    printf("                  '-p /tmp/net,/tmp/alarm:9,/tmp/player:0:112'.\n");
+    printf("                  Fifos with a higher priority (default 0) are read\n");
+    printf("                  first. With a prefix [0..255] the bytes of the fifo\n");
+    printf("                  are sent in blocks of up to %d bytes, each after the\n", PREFIXED_MAX);
+    printf("                  prefix and its length byte. Several fifos imply '-k'.\n");
+    printf("  -r <file>       record the bytes of the fifos to <file>, implies '-C'\n");
+    printf("  -R <file>       replay a file of -r instead of reading the fifos.\n");
+    printf("                  The fifos of '-p' give the priorities and prefixes.\n");
+    printf("  -x <speed>      speed factor of -R, 0: as fast as possible. Default: 1\n");
     printf("  -t              testmode\n");
+    printf("  -c <file>       config file with further options, read again on SIGHUP.\n");
+    printf("                  Priorities and prefixes of '-p' change while running,\n");
+    printf("                  the paths have to stay the same.\n");
+    printf("  -k              keep the fifo open, so writers never wait for\n");
+    printf("                  the reader, and reopen it if the path is deleted\n");
+    printf("                  or replaced\n");
+    printf("  -C              always copy with read()/write(), don't splice()\n");
+    printf("                  the fifo to stdout\n");
+    printf("  -o <policy>     what to do if stdout is not read fast enough and the\n");
+    printf("                  queue is full: 'oldest' or 'newest' (drop chunks),\n");
+    printf("                  'coalesce' (keep the latest chunk) or 'block'\n");
+    printf("                  (stop reading, the writers wait). Default: block\n");
+    printf("                  Other policies than 'block' imply '-k' and '-C'.\n");
+    printf("  -q <bytes>      size of the stdout queue. Default: %d\n", QUEUE_SIZE);
+    printf("  -B <MiB>        benchmark: relay <MiB> through pipes with splice()\n");
+    printf("                  and with read()/write() and print the throughput\n");
     printf("\n");
+    printf("SIGUSR1 logs runtime statistics.\n");
+    printf("\n");
+}
+
+#endif
+
+
+/* Parses <path>[:<priority>[:<prefix>]] from the end, so the path may
+ * contain ':' unless it ends with ':<integer>'. Cuts item after the path. */
+static int parse_fifo_item(char *item, int *priority, int *prefix) {
+
+	int value[2];
+	int nb = 0;
+	char *colon;
+
+	while (	nb < 2 && (colon = strrchr(item, ':')) != NULL 
+		&&	colon[1] != '\0' && str_to_int(colon + 1, &value[nb])) {
+
+		*colon = '\0';
+		nb++;
+	}
+
+	*priority = nb == 0 ? 0 : value[nb-1];
+	*prefix = nb == 2 ? value[0] : -1;
+
+	if (nb == 2 && (*prefix < 0 || *prefix > 255)) {
+		error("Prefix of fifo '%s' is not an integer from [0..255].", item);
+		return 0;
+	}
+
+	if (*item == '\0') {
+		error("Empty fifo path given.");
+		return 0;
+	}
+	return 1;
+}
+
+
+static int init_fifo(Fifo *f, char *item) {
+
+	f->path = item;
+	f->dir = NULL;
+	f->name = NULL;
+	f->fd = -1;
+	f->keepFd = -1;
+	f->wd = -1;
+
+	if (!parse_fifo_item(item, &f->priority, &f->prefix))
+		return 0;
+
+	/* inotify watches the directory for the name of the fifo */
+	char *slash = strrchr(f->path, '/');
+	f->dir = slash == NULL ? make_str(".") 
+				: make_str("%.*s", (int)(slash - f->path + 1), f->path);
+	if (f->dir == NULL)
+		return 0;
+	f->name = slash == NULL ? f->path : slash + 1;
+	return 1;
 }
 
+
 static int init_settings() {
    
     settings = malloc(sizeof(Settings));
@@ -84,94 +252,687 @@ static int init_settings() {
 		return 0;
 	}
 
-    settings->fifoPath = NULL;
 	settings->testmode = 0;
-	    
-	if (!get_opt_str('p', 1, &settings->fifoPath))
+	settings->useSplice = 0;
+	settings->replayPath = NULL;
+	settings->replaySpeed = 1;
+	settings->persistent = 0;
+	settings->inotifyFd = -1;
+	settings->roundDeferred = 0;
+	settings->readyNb = 0;
+	settings->inotify = 0;
+	settings->items = NULL;
+	settings->fifoNb = 0;
+	settings->statChunks = stat_counter("fifo chunks");
+	settings->statBytes = stat_counter("fifo bytes");
+	settings->statReattach = stat_counter("fifo reattached");
+
+	char *paths;
+	if (!get_opt_str('p', 1, &paths))
 		return 0;
+
+	int nb = split_str(paths, ',', &settings->items);
+	if (nb < 1 || nb > FIFO_MAX) {
+		error("Option '-p' needs 1 to %d fifo paths.", FIFO_MAX);
+		return 0;
+	}
+
+	int i;
+	for (i = 0; i < nb; i++) {
+		settings->fifo[i].nr = i;
+		settings->fifoNb++;
+		if (!init_fifo(&settings->fifo[i], settings->items[i]))
+			return 0;
+	}
 		
     if (get_opt_str('t', 0, NULL))
 		settings->testmode = 1;        
 
+	char *capPath;
+	if (get_opt_str('r', 0, &capPath) && !cap_open(capPath))
+		return 0;
+
+	if (	get_opt_str('R', 0, &settings->replayPath)
+		&&	!get_opt_int_between('x', 1, 0, 1000, 1, &settings->replaySpeed)) {
+
+		return 0;
+	}
+
+	/* dropping needs the queue and the queue needs the event loop */
+	char *policy;
+	int dropping = get_opt_str('o', 0, &policy) && strcmp(policy, "block") != 0;
+
+	if (get_opt_str('k', 0, NULL) || settings->fifoNb > 1 || dropping)
+		settings->persistent = 1;
+
+	/* splice() needs a pipe on one side, the fifo is one. The bytes of
+	 * several fifos are copied, so a chunk is never split by another. A
+	 * capture has to see the bytes. */
+	struct stat st;
+	if (	CAN_SPLICE && !settings->testmode 
+		&&	settings->fifoNb == 1 && settings->fifo[0].prefix < 0
+		&&	!get_opt_str('C', 0, NULL) && !dropping
+		&&	!cap_active() && settings->replayPath == NULL
+		&&	fstat(1, &st) == 0 && S_ISFIFO(st.st_mode)) {
+
+		settings->useSplice = 1;
+	}
+
+	/* without the event loop or with splice() stdout stays blocking */
+	if (	!settings->testmode && settings->persistent && !settings->useSplice
+		&&	!init_output_opt('o', 'q', OUT_BLOCK, QUEUE_SIZE)) {
+		
+		return 0;
+	}
+
 	return 1;
 }
 
 
-static int handle_fifo() {
+/* One splice() call. Returns the number of bytes (0 on EOF), -1 on errors
+ * or -2 if splice() isn't supported for the fds. */
+static ssize_t relay_splice_once(int in, int out) {
+
+	ssize_t nb;
+	do {
+		nb = splice(in, NULL, out, NULL, SPLICE_SIZE, SPLICE_F_MOVE);
+	} while (nb < 0 && errno == EINTR);
+
+	if (nb < 0 && errno == EINVAL)
+		return -2;
+	return nb;
+}
+
+
+#ifndef CTRL_MULTI
+
+/* the blocking relays of the benchmark */
+
+static int write_all(int out, unsigned char *buf, int nb) {
+
+	int pos = 0;
+	while (pos < nb) {
+		int r = write(out, buf + pos, nb - pos);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			return 0;
+		}
+		pos += r;
+	}
+	return 1;
+}
+
+
+/* One read() and write()s until it is written. Returns the number of
+ * bytes (0 on EOF) or -1. */
+static int relay_copy_once(int in, int out) {
+
+    int bufSize = 100;
+    unsigned char buf[bufSize];
+
+	int nb = read(in, buf, bufSize);
+	
+	if (nb > 0 && !write_all(out, buf, nb))
+		return -1;
+	return nb;
+}
+
+
+/* Copies from in to out until EOF. Returns the number of bytes or -1. */
+static long long relay_copy(int in, int out) {
+
+	long long total = 0;
+	int nb;
+    
+	while ((nb = relay_copy_once(in, out)) > 0)
+		total += nb;
+
+	return nb < 0 && errno != EAGAIN ? -1 : total;
+}
+
+
+/* Moves data from in to out inside the kernel until EOF. Returns the number
+ * of bytes, -1 on errors or -2 if splice() isn't supported for the fds
+ * before any data was moved. */
+static long long relay_splice(int in, int out) {
+
+	long long total = 0;
+
+	while (1) {
+		ssize_t nb = relay_splice_once(in, out);
+		if (nb == -2 && total == 0)
+			return -2;
+		if (nb < 0)
+			return -1;
+		if (nb == 0)
+			break;
+		total += nb;
+	}
+	return total;
+}
+
+
+#endif
+
+
+static void record_chunk(Fifo *f, const unsigned char *buf, int nb) {
+
+	static unsigned char rec[CAP_DATA_MAX];
+
+	if (!cap_active())
+		return;
+
+	int pos;
+	for (pos = 0; pos < nb; pos += CAP_DATA_MAX - 1) {
+		int len = nb - pos < CAP_DATA_MAX - 1 ? nb - pos : CAP_DATA_MAX - 1;
+		rec[0] = f->nr;
+		memcpy(rec + 1, buf + pos, len);
+		cap_write(CAP_CHUNK, rec, len + 1);
+	}
+}
+
+
+/* Writes or queues the bytes as one unit. If the fifo has a prefix they
+ * go in units of up to PREFIXED_MAX bytes, each after the prefix and its
+ * length byte. Returns 0 on errors. */
+static int relay_bytes(Fifo *f, const unsigned char *buf, int nb) {
+
+	unsigned char prefixed[2 + PREFIXED_MAX];
+
+	if (f->prefix < 0)
+		return out_write(buf, nb);
+
+	while (nb > 0) {
+		int len = nb < PREFIXED_MAX ? nb : PREFIXED_MAX;
+		prefixed[0] = f->prefix;
+		prefixed[1] = len;
+		memcpy(prefixed + 2, buf, len);
+		if (!out_write(prefixed, 2 + len))
+			return 0;
+		buf += len;
+		nb -= len;
+	}
+	return 1;
+}
+
+
+/* Reads everything that is in the fifo - atomic writes of up to PIPE_BUF
+ * bytes are never split - and relays it as one unit. Returns the number
+ * of bytes read (0 on EOF) or -1. */
+static int relay_chunk(Fifo *f) {
+
+	static unsigned char buf[CHUNK_SIZE];
+
+	int nb = read(f->fd, buf, sizeof(buf));
+	if (nb <= 0)
+		return nb;
+
+	record_chunk(f, buf, nb);
+	return relay_bytes(f, buf, nb) ? nb : -1;
+}
+
+
+/* Opens the fifo, creates it if it doesn't exist. Returns the fd or -1. */
+static int open_fifo(Fifo *f, int flags) {
 		
 	int fd = -1;
 	int mkfifoCalled = 0;
 	
-	while (fd < 0 && !mkfifoCalled) {
+	while (fd < 0) {
 		if (settings->testmode)
-			printf("\nTry to open fifo '%s'...\n",settings->fifoPath);
-		fd = open(settings->fifoPath, O_RDONLY);
+			trace("\nTry to open fifo '%s'...\n",f->path);
+		fd = open(f->path, flags);
 		if (fd < 0) {
 			int err = errno;
 			if (settings->testmode)
-				printf("Failed to open fifo: %s.\n",strerror(err));
+				trace("Failed to open fifo: %s.\n",strerror(err));
 			if (err == ENOENT && !mkfifoCalled) {
 				if (settings->testmode)
-					printf("Try to create fifo...\n");
+					trace("Try to create fifo...\n");
 				mkfifoCalled = 1;
-				if (mkfifo(settings->fifoPath, 0600) != 0) {
+				if (mkfifo(f->path, 0600) != 0) {
 					err = errno;
-					error("Couldn't create fifo '%s': %s.",settings->fifoPath, strerror(err));
-					return 0;
+					error("Couldn't create fifo '%s': %s.",f->path, strerror(err));
+					return -1;
 				} else {
 					if (settings->testmode)
-						printf("Fifo created.\n");
+						trace("Fifo created.\n");
 				}
 			} else {
-				error("Couldn't open fifo '%s': %s.",settings->fifoPath, strerror(err));
-				return 0;
+				error("Couldn't open fifo '%s': %s.",f->path, strerror(err));
+				return -1;
 			}			
 		}
 	}
 
 	if (settings->testmode)
-		printf("Fifo opened.\n");
+		trace("Fifo opened.\n");
+	return fd;
+}
 
-    int bufSize = 100;
-    unsigned char buf[bufSize];
-    
-    int i;
-    
-    while(1) {
-		int nb = read(fd, buf, bufSize);
-		
-		if (settings->testmode) {
-			for (i = 0; i < nb; i++) 
-				printf("Byte %3d: %s\n",i,get_multi_base_str(buf[i]));
-		} else {
-			int pos = 0;
-			while (pos < nb) {
-				int r = write(1, buf + pos, nb - pos);
-				if (r < 0)
-					break;
-				pos += r;
-			}
+
+static void print_bytes(Fifo *f, const unsigned char *buf, int nb) {
+
+	char str[MULTI_BASE_STR_LEN];
+	int i;
+	for (i = 0; i < nb; i++) {
+		if (settings->fifoNb > 1)
+			trace("Fifo %d Byte %3d: %s\n", f->nr, i, get_multi_base_str(buf[i], str));
+		else
+			trace("Byte %3d: %s\n", i, get_multi_base_str(buf[i], str));
+	}
+}
+
+
+static int fifo_ready(int fd, uint32_t events, void *data);
+
+
+/* Opens the fifo for reading - and with '-k', so there is always a writer,
+ * for writing. Writers never block in open() as there is always a reader.
+ * The read end is blocking again once opened; it is only read after epoll
+ * reported data or EOF, so a read never waits. */
+static int attach_fifo(Fifo *f) {
+
+	int fd = open_fifo(f, O_RDONLY | O_NONBLOCK);
+	if (fd < 0)
+		return 0;
+	f->fd = fd;
+
+	if (settings->persistent) {
+		f->keepFd = open(f->path, O_WRONLY | O_NONBLOCK);
+		if (f->keepFd < 0) {
+			int err = errno;
+			error("Couldn't open fifo '%s' for writing: %s.",f->path, strerror(err));
+			return 0;
 		}
-    
-		if (nb <= 0)
-			break;
-	}    
-    
-    close(fd);
+	}
+
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+
+	return loop_add_fd(fd, EPOLLIN, fifo_ready, f);
+}
+
+
+/* Passes on what is left in the old fifo and closes it. */
+static void detach_fifo(Fifo *f) {
+
+	int i;
+	for (i = 0; i < settings->readyNb; i++)
+		if (settings->ready[i] == f)
+			settings->ready[i] = NULL;
+
+	loop_del_fd(f->fd);
+	fcntl(f->fd, F_SETFL, fcntl(f->fd, F_GETFL) | O_NONBLOCK);
+	if (!settings->testmode)
+		relay_chunk(f);
+
+	close(f->fd);
+	f->fd = -1;
+	if (f->keepFd >= 0)
+		close(f->keepFd);
+	f->keepFd = -1;
+
 	if (settings->testmode)
-		printf("Fifo closed.\n");
-    return 1;
+		trace("Fifo closed.\n");
+}
+
+
+/* Called for inotify events on the name of the fifo. Reattaches if the
+ * path was deleted or now points to another file. */
+static int check_fifo_path(Fifo *f) {
+
+	struct stat pathSt, fdSt;
+
+	if (	stat(f->path, &pathSt) == 0 
+		&&	fstat(f->fd, &fdSt) == 0
+		&&	pathSt.st_dev == fdSt.st_dev && pathSt.st_ino == fdSt.st_ino) {
+
+		return 1;
+	}
+
+	if (settings->testmode)
+		trace("\nFifo '%s' was deleted or replaced.\n", f->path);
+
+	stat_add(settings->statReattach, 1);
+	detach_fifo(f);
+	return attach_fifo(f);
+}
+
+
+static int handle_inotify() {
+
+	char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	int nb = read(settings->inotifyFd, buf, sizeof(buf));
+	if (nb <= 0)
+		return 1;
+
+	int check[FIFO_MAX] = {0};
+	int i;
+	char *p;
+	for (p = buf; p < buf + nb; p += sizeof(struct inotify_event) + ((struct inotify_event *)p)->len) {
+		struct inotify_event *ev = (struct inotify_event *)p;
+		for (i = 0; ev->len > 0 && i < settings->fifoNb; i++) 
+			if (ev->wd == settings->fifo[i].wd && strcmp(ev->name, settings->fifo[i].name) == 0)
+				check[i] = 1;
+	}
+
+	for (i = 0; i < settings->fifoNb; i++)
+		if (check[i] && !check_fifo_path(&settings->fifo[i]))
+			return 0;
+	return 1;
+}
+
+
+/* Returns the number of bytes (0 on EOF) or -1. */
+static ssize_t relay_fifo_once(Fifo *f) {
+
+	if (settings->testmode) {
+		unsigned char buf[100];
+		int nb = read(f->fd, buf, sizeof(buf));
+		if (nb > 0)
+			record_chunk(f, buf, nb);
+		print_bytes(f, buf, nb);
+		return nb;
+	}
+
+	if (settings->useSplice) {
+		ssize_t r = relay_splice_once(f->fd, 1);
+		if (r != -2)
+			return r;
+		info("splice() not supported - copying instead.");
+		settings->useSplice = 0;
+	}
+	return relay_chunk(f);
+}
+
+
+/* Runs once after all events of a round: the fifos with data by priority,
+ * then inotify, so a replaced fifo is drained before. */
+static int end_of_round(void *data) {
+
+	int i;
+	for (i = 0; i < settings->readyNb; i++) {
+
+		Fifo *f = settings->ready[i];
+		if (f == NULL)
+			continue;
+
+		ssize_t r = relay_fifo_once(f);
+		if (r < 0) {
+			int err = errno;
+			error("Couldn't relay fifo '%s': %s.", f->path, strerror(err));
+			return 0;
+		}
+		stat_add(settings->statChunks, 1);
+		stat_add(settings->statBytes, r);
+
+		/* without '-k' the last writer is gone, wait for the next one */
+		if (r == 0) {
+			stat_add(settings->statReattach, 1);
+			detach_fifo(f);
+			if (!attach_fifo(f))
+				return 0;
+		}
+	}
+	settings->readyNb = 0;
+
+	if (settings->inotify && !handle_inotify())
+		return 0;
+	settings->inotify = 0;
+
+	settings->roundDeferred = 0;
+	return 1;
+}
+
+
+static int defer_round() {
+
+	if (settings->roundDeferred)
+		return 1;
+	settings->roundDeferred = 1;
+	return loop_defer(end_of_round, NULL);
+}
+
+
+/* Sorts the fifo in by priority, equal ones by insertion. */
+static int fifo_ready(int fd, uint32_t events, void *data) {
+
+	Fifo *f = data;
+	int j;
+	for (j = settings->readyNb; j > 0 && settings->ready[j-1]->priority < f->priority; j--)
+		settings->ready[j] = settings->ready[j-1];
+	settings->ready[j] = f;
+	settings->readyNb++;
+
+	return defer_round();
+}
+
+
+static int inotify_ready(int fd, uint32_t events, void *data) {
+
+	settings->inotify = 1;
+	return defer_round();
 }
 
 
-static void signalHandler(int sig) {
-	my_exit(EXIT_SUCCESS);
+/* With '-k' the fifos are kept open for the whole life of the process.
+ * Writers never block in open(), since there is always a reader, and the
+ * reader never sees EOF, since it holds a write end itself. */
+static int start_fifos() {
+
+	if (!loop_init())
+		return 0;
+
+	int i;
+	if (settings->persistent) {
+
+		settings->inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		if (settings->inotifyFd < 0) {
+			int err = errno;
+			error("Can't set up inotify: %s.", strerror(err));
+			return 0;
+		}
+
+		for (i = 0; i < settings->fifoNb; i++) {
+			Fifo *f = &settings->fifo[i];
+			f->wd = inotify_add_watch(settings->inotifyFd, f->dir, 
+						IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO);
+			if (f->wd < 0) {
+				int err = errno;
+				error("Can't watch directory '%s': %s.", f->dir, strerror(err));
+				return 0;
+			}
+		}
+
+		if (!loop_add_fd(settings->inotifyFd, EPOLLIN, inotify_ready, NULL))
+			return 0;
+	}
+
+	for (i = 0; i < settings->fifoNb; i++)
+		if (!attach_fifo(&settings->fifo[i]))
+			return 0;
+
+	return 1;
+}
+
+
+/* Replay of -R: the recorded chunks take the place of the fifos. */
+static int replay_chunk(int type, const unsigned char *buf, int nb, const struct timespec *at, void *data) {
+
+	if (type != CAP_CHUNK || nb < 1 || buf[0] >= settings->fifoNb)
+		return 1;
+
+	Fifo *f = &settings->fifo[buf[0]];
+	stat_add(settings->statChunks, 1);
+	stat_add(settings->statBytes, nb - 1);
+
+	if (settings->testmode) {
+		print_bytes(f, buf + 1, nb - 1);
+		return 1;
+	}
+	if (!relay_bytes(f, buf + 1, nb - 1)) {
+		error("Couldn't relay replayed bytes of fifo '%s'.", f->path);
+		return 0;
+	}
+	return 1;
+}
+
+
+static int start() {
+
+	if (!init_settings()) 
+		return 0;
+
+	if (settings->replayPath != NULL)
+		return	loop_init() 
+			&&	cap_replay(settings->replayPath, settings->replaySpeed, replay_chunk, NULL);
+	
+	if (settings->testmode) {
+		printf("\nTest mode - %s\n",RELEASE);
+		int i;
+		for (i = 0; i < settings->fifoNb; i++)
+			printf("Please write some bytes to '%s'.\n",settings->fifo[i].path);
+	}
+
+	return start_fifos();
+}
+
+
+#ifdef CTRL_MULTI
+
+Backend fifoBackend = { "fifo", OPTIONS, 0, start, free_settings };
+
+#else
+
+
+/* Called on SIGHUP with the options of the config file: takes the new
+ * priorities and prefixes of the same fifos. They stay open, writers
+ * don't notice. */
+static int reload_settings() {
+
+	char *paths;
+	char **items;
+	if (!get_opt_str('p', 1, &paths))
+		return 0;
+
+	int nb = split_str(paths, ',', &items);
+	if (nb != settings->fifoNb) {
+		error("Option '-p' needs the same %d fifos.", settings->fifoNb);
+		free(items);
+		return 0;
+	}
+
+	int priority[FIFO_MAX], prefix[FIFO_MAX];
+	int i;
+	for (i = 0; i < nb; i++) {
+		if (!parse_fifo_item(items[i], &priority[i], &prefix[i])) {
+			free(items);
+			return 0;
+		}
+		if (strcmp(items[i], settings->fifo[i].path) != 0) {
+			error("Fifo '%s' can't be changed while running.", settings->fifo[i].path);
+			free(items);
+			return 0;
+		}
+		/* splice() passes the bytes on unchanged */
+		if (settings->useSplice && prefix[i] >= 0) {
+			error("A prefix needs option '-C' before the fifo is opened.");
+			free(items);
+			return 0;
+		}
+	}
+	free(items);
+
+	for (i = 0; i < nb; i++) {
+		settings->fifo[i].priority = priority[i];
+		settings->fifo[i].prefix = prefix[i];
+	}
+	return 1;
+}
+
+
+static double seconds_since(struct timespec *t) {
+	
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - t->tv_sec) + (now.tv_nsec - t->tv_nsec) / 1e9;
+}
+
+
+/* Forks a child that writes mib MiB into a pipe and one that discards
+ * everything from a second pipe, and relays between them. */
+static double benchmark_relay(int mib, int useSplice) {
+
+	int in[2], out[2];
+	if (pipe(in) != 0 || pipe(out) != 0) {
+		error("Can't create pipes.");
+		return -1;
+	}
+
+	pid_t writer = fork();
+	if (writer == 0) {
+		close(in[0]); close(out[0]); close(out[1]);
+		static char chunk[SPLICE_SIZE];
+		memset(chunk, 'x', sizeof(chunk));
+		long long left = (long long)mib * 1024 * 1024;
+		while (left > 0) {
+			int r = write(in[1], chunk, left < SPLICE_SIZE ? left : SPLICE_SIZE);
+			if (r < 0)
+				_exit(1);
+			left -= r;
+		}
+		_exit(0);
+	}
+
+	pid_t reader = fork();
+	if (reader == 0) {
+		close(in[0]); close(in[1]); close(out[1]);
+		static char chunk[SPLICE_SIZE];
+		while (read(out[0], chunk, sizeof(chunk)) > 0);
+		_exit(0);
+	}
+
+	close(in[1]);
+	close(out[0]);
+
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	long long nb = useSplice ? relay_splice(in[0], out[1]) : relay_copy(in[0], out[1]);
+	close(out[1]);
+	close(in[0]);
+	waitpid(writer, NULL, 0);
+	waitpid(reader, NULL, 0);
+	double sec = seconds_since(&start);
+
+	if (nb != (long long)mib * 1024 * 1024) {
+		error("Benchmark relayed %lld bytes instead of %d MiB.", nb, mib);
+		return -1;
+	}
+	return mib / sec;
+}
+
+
+static int benchmark() {
+
+	int mib;
+	if (!get_opt_int_between('B', 1, 1, 100000, 0, &mib))
+		return 0;
+
+	double copyRate = benchmark_relay(mib, 0);
+	double spliceRate = benchmark_relay(mib, 1);
+	if (copyRate < 0 || spliceRate < 0)
+		return 0;
+
+	printf("read()/write(): %10.1f MiB/s\n", copyRate);
+	printf("splice():       %10.1f MiB/s\n", spliceRate);
+	return 1;
 }
 
 
 int main(int argc, char *argv[]){
 	
-	if (!init_util_sig(PROG, argc, argv, ":hp:t", signalHandler))
+	if (!init_util(PROG, argc, argv, OPTIONS))
 		my_exit(EXIT_FAILURE);
     
     if (get_opt_str('h', 0, NULL)) {
@@ -179,18 +940,15 @@ int main(int argc, char *argv[]){
 		my_exit(EXIT_SUCCESS);
 	}
 
-	if (!init_settings()) 
-		my_exit(EXIT_FAILURE);
-	
-	if (settings->testmode)
-		printf("\nTest mode - %s\n",RELEASE);
-		printf("Please write some bytes to '%s'.\n",settings->fifoPath);
+    if (get_opt_str('B', 0, NULL)) 
+		my_exit(benchmark() ? EXIT_SUCCESS : EXIT_FAILURE);
 
-    while (1) {
+	if (!init_config('c', reload_settings) || !start())
+		my_exit(EXIT_FAILURE);
 
-		if (!handle_fifo()) 
-			my_exit(EXIT_FAILURE);
-	}
+	my_exit(loop_run() ? EXIT_SUCCESS : EXIT_FAILURE);
 	
 	return EXIT_FAILURE;
 }
+
+#endif
@@ -0,0 +1,346 @@
+/* ctrl_multi is a controller for the plugin Control of lcd4linux, that runs
+ * ctrl_fifo, ctrl_serial and ctrl_usbmouse as backends in one process.
+ *
+ * Build: gcc -DCTRL_MULTI -o ctrl_multi ctrl_multi.c ctrl_fifo.c 
+ *            ctrl_serial.c ctrl_usbmouse.c util.c -lusb-1.0 -lm -lpthread
+ *
+ * Copyright (C) 2015 Marcus Menzel <codingmax@gmx-topmail.de>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ * 
+ * http://www.gnu.org/licenses/gpl-2.0.html
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "util.h"
+#include "backend.h"
+
+#define PROG "ctrl_multi"
+#define RELEASE PROG " 0.0.1"
+
+#define OPTIONS ":f:F:ho:q:s:S:tu:U:"
+
+#define BACKEND_NB 3
+
+/* first size of the buffer of map_output(), a chunk of ctrl_fifo */
+#define MAP_BUF (64*1024)
+
+typedef struct Input {
+	Backend *backend;
+	char **items;              /* of the option string, argv of the backend */
+	unsigned char map[256];    /* output byte of every input byte */
+	unsigned char state;       /* latest mapped byte of a state backend */
+	char *unitKeys;            /* options for units of several bytes */
+	int started;
+} Input;
+
+typedef struct Settings {
+	int inputNb;
+	Input input[BACKEND_NB];
+	unsigned char *buf;        /* mapped bytes of event backends */
+	int bufSize;
+} Settings;
+
+static Settings *settings = NULL;
+
+
+static void my_exit(int retVal) {
+
+	if (settings != NULL) {
+		int i;
+		for (i = 0; i < settings->inputNb; i++) {
+			Input *in = &settings->input[i];
+			if (in->started)
+				in->backend->free();
+			free(in->items);
+		}
+		free(settings->buf);
+		free(settings);
+		settings = NULL;
+	}
+
+	cap_close();
+	loop_free();
+	free_output();
+	info("Exit.");
+	exit(retVal);
+}
+
+
+static void print_info() {
+	printf("\n%s\n", RELEASE);
+    printf("\n");
+    printf("This program is a controller for the plugin Control of lcd4linux.\n");
+    printf("It runs ctrl_fifo, ctrl_serial and ctrl_usbmouse as backends in one\n");
+    printf("process and merges their bytes into one stream on stdout.\n");
+    printf("The bytes of ctrl_serial and ctrl_usbmouse are button states: every\n");
+    printf("byte written is the OR of the latest (mapped) bytes of both. Bytes of\n");
+    printf("ctrl_fifo are mapped and written as they are. So the options for\n");
+    printf("units of several bytes, '-G' of ctrl_serial and '-F' and '-G' of\n");
+    printf("ctrl_usbmouse, are not supported.\n");
+    printf("Please visit the wiki for further information.\n");
+    printf("\n");
+    printf("usage: %s [options]",PROG);
+    printf("\n");
+    printf("options:\n");
+    printf("  -h              help (this info)\n");
+    printf("  -f <options>    run ctrl_fifo with the given options, e.g.\n");
+    printf("                  -f '-k -p /tmp/l4l_fifo'\n");
+    printf("  -s <options>    run ctrl_serial with the given options\n");
+    printf("  -u <options>    run ctrl_usbmouse with the given options\n");
+    printf("                  At least one backend is NOT optional. Values of\n");
+    printf("                  the options must not contain spaces, '-o' and\n");
+    printf("                  '-q' of the backends are ignored.\n");
+    printf("  -F <map>        bit mapping of the bytes of ctrl_fifo: the output\n");
+    printf("                  bit of input bits 0 to 7, '-' drops the bit.\n");
+    printf("                  Default: 01234567\n");
+    printf("  -S <map>        bit mapping of ctrl_serial, e.g. 0123----\n");
+    printf("  -U <map>        bit mapping of ctrl_usbmouse, e.g. 45----67\n");
+    printf("  -t              testmode (SIGINT and SIGQUIT end the program)\n");
+    printf("  -o <policy>     what to do if stdout is not read fast enough and the\n");
+    printf("                  queue is full: 'oldest' or 'newest' (drop bytes),\n");
+    printf("                  'coalesce' (keep the latest state) or 'block'.\n");
+    printf("                  Default: oldest\n");
+    printf("  -q <bytes>      size of the stdout queue. Default: 4096\n");
+    printf("\n");
+    printf("SIGUSR1 logs runtime statistics.\n");
+    printf("\n");
+}
+
+
+static int init_map(Input *in, char key) {
+
+	char *str = "01234567";
+	get_opt_str(key, 0, &str);
+
+	int target[8];
+	int i, v;
+	for (i = 0; i < 8; i++) {
+		if (strlen(str) != 8 || ((str[i] < '0' || str[i] > '7') && str[i] != '-')) {
+			error("Value of option '-%c' has to be 8 characters of '0'-'7' or '-'.", key);
+			return 0;
+		}
+		target[i] = str[i] == '-' ? -1 : str[i] - '0';
+	}
+
+	for (v = 0; v < 256; v++) {
+		in->map[v] = 0;
+		for (i = 0; i < 8; i++)
+			if ((v & (1 << i)) && target[i] >= 0)
+				in->map[v] |= 1 << target[i];
+	}
+	return 1;
+}
+
+
+/* Splits the option string of a backend into an argv, argv[0] is the name
+ * of the backend. */
+static int init_items(Input *in, char *opts) {
+
+	char **parts;
+	int nb = split_str(opts, ' ', &parts);
+	if (nb < 0)
+		return 0;
+
+	in->items = malloc((nb + 2) * sizeof(char *) + strlen(opts) + 1);
+	if (in->items == NULL) {
+		noMem();
+		free(parts);
+		return 0;
+	}
+
+	/* the strings are copied behind the pointers, so one free() does */
+	char *copy = (char *)(in->items + nb + 2);
+	int argc = 0;
+	int i;
+	in->items[argc++] = in->backend->name;
+	for (i = 0; i < nb; i++) {
+		if (*parts[i] == '\0')
+			continue;
+		strcpy(copy, parts[i]);
+		in->items[argc++] = copy;
+		copy += strlen(copy) + 1;
+	}
+	in->items[argc] = NULL;
+
+	free(parts);
+	return 1;
+}
+
+
+static int init_settings() {
+
+	static Backend *backends[BACKEND_NB] = { &fifoBackend, &serialBackend, &usbmouseBackend };
+	static char optKeys[BACKEND_NB] = { 'f', 's', 'u' };
+	static char mapKeys[BACKEND_NB] = { 'F', 'S', 'U' };
+	/* the bytes of state backends are merged one by one */
+	static char *unitKeys[BACKEND_NB] = { "", "G", "FG" };
+
+	if (get_args(NULL) != 0) {
+		error("Non-option arguments given but not allowed.");
+		return 0;
+	}
+
+	settings = malloc(sizeof(Settings));
+	if (settings == NULL) {
+		noMem();
+		return 0;
+	}
+	settings->inputNb = 0;
+	settings->buf = malloc(MAP_BUF);
+	settings->bufSize = MAP_BUF;
+	if (settings->buf == NULL) {
+		noMem();
+		return 0;
+	}
+
+	int i;
+	for (i = 0; i < BACKEND_NB; i++) {
+
+		char *opts;
+		if (!get_opt_str(optKeys[i], 0, &opts))
+			continue;
+
+		Input *in = &settings->input[settings->inputNb++];
+		in->backend = backends[i];
+		in->items = NULL;
+		in->state = 0;
+		in->unitKeys = unitKeys[i];
+		in->started = 0;
+
+		if (!init_items(in, opts) || !init_map(in, mapKeys[i]))
+			return 0;
+	}
+
+	if (settings->inputNb == 0) {
+		error("No backend given (options '-f', '-s', '-u').");
+		return 0;
+	}
+	return 1;
+}
+
+
+/* Output map of util, owner is the number of the input + 1. */
+static int map_output(int owner, const unsigned char *buf, int nb) {
+
+	if (owner < 1 || owner > settings->inputNb)
+		return out_write(buf, nb);
+
+	Input *in = &settings->input[owner-1];
+	int i, j;
+
+	if (in->backend->state) {
+		for (i = 0; i < nb; i++) {
+			in->state = in->map[buf[i]];
+			unsigned char merged = 0;
+			for (j = 0; j < settings->inputNb; j++)
+				if (settings->input[j].backend->state)
+					merged |= settings->input[j].state;
+			if (!out_write(&merged, 1))
+				return 0;
+		}
+		return 1;
+	}
+
+	/* grows only, and by doubling */
+	if (nb > settings->bufSize) {
+		int size = settings->bufSize;
+		while (size < nb)
+			size *= 2;
+		unsigned char *b = realloc(settings->buf, size);
+		if (b == NULL) {
+			noMem();
+			return 0;
+		}
+		settings->buf = b;
+		settings->bufSize = size;
+	}
+	for (i = 0; i < nb; i++)
+		settings->buf[i] = in->map[buf[i]];
+	return out_write(settings->buf, nb);
+}
+
+
+static int count_items(char **items) {
+	int nb;
+	for (nb = 0; items[nb] != NULL; nb++);
+	return nb;
+}
+
+
+/* Starts every backend with its options current and its sources owned by
+ * it, so map_output() knows where a byte comes from. */
+static int start_backends() {
+
+	int i;
+	for (i = 0; i < settings->inputNb; i++) {
+
+		Input *in = &settings->input[i];
+		if (!push_opts(in->backend->optString, count_items(in->items), in->items))
+			return 0;
+
+		char *key;
+		for (key = in->unitKeys; *key != '\0'; key++) {
+			if (get_opt_str(*key, 0, NULL)) {
+				error("Option '-%c' of %s isn't supported here.", *key, in->backend->name);
+				pop_opts();
+				return 0;
+			}
+		}
+
+		loop_set_owner(i + 1);
+		in->started = 1;
+		int ok = in->backend->start();
+		loop_set_owner(0);
+		pop_opts();
+
+		if (!ok) {
+			error("Can't start backend %s.", in->backend->name);
+			return 0;
+		}
+	}
+	return 1;
+}
+
+
+int main(int argc, char *argv[]) {
+
+	if (!init_util(PROG, argc, argv, OPTIONS))
+		my_exit(EXIT_FAILURE);
+
+	if (get_opt_str('h', 0, NULL)) {
+		print_info();
+		my_exit(EXIT_SUCCESS);
+	}
+
+	if (	!init_settings()
+		||	!loop_init()
+		||	(!get_opt_str('t', 0, NULL) && !init_output_opt('o', 'q', OUT_DROP_OLDEST, 4096))) {
+
+		my_exit(EXIT_FAILURE);
+	}
+
+	out_set_map(map_output);
+
+	if (!start_backends())
+		my_exit(EXIT_FAILURE);
+
+	my_exit(loop_run() ? EXIT_SUCCESS : EXIT_FAILURE);
+	return EXIT_FAILURE;
+}
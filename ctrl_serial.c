@@ -22,54 +22,263 @@
  */
     
     
+#define _GNU_SOURCE
+
 #include <fcntl.h>   
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <sys/ioctl.h>
-#include <sys/poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <time.h>
 #include <unistd.h>    
 #include <math.h>    
 #include <errno.h>
 #include <string.h>
+#include <signal.h>
+#include <pthread.h>
+#include <linux/serial.h>
 
 #include "util.h"
+#include "backend.h"
 
 #define PROG "ctrl_serial"
 #define RELEASE PROG " 0.0.1"
 
+#define BUTTON_PINS (TIOCM_RNG | TIOCM_CTS | TIOCM_DSR | TIOCM_CD)
+
+static const int buttonPins[] = { TIOCM_RNG, TIOCM_CTS, TIOCM_DSR,  TIOCM_CD };
+
+#define OPTIONS ":b:c:d:D:e:E:Gho:Pp:q:r:R:S:tTx:2:3:4:5:6:7:8:"
+
+/* maximal number of serial ports handled by one process */
+#define PORTS_MAX 4
+
+/* LED command bytes with more than 1 port */
+#define LED_SELECT     100  /* + <n>: following commands go to port <n> */
+#define LED_SELECT_ALL 200  /* following commands go to all ports */
+
+#define RING_SIZE 1024    /* samples between the thread of -T and the loop */
+
+#define SIM_BUTTONS 0
+#define SIM_LED     1
+#define SIM_TAIL_MS 1000  /* time to settle after the last event of a script */
+
+/* records of -r, those of a port start with its number */
+#define CAP_LINES   1     /* int: TIOCMGET result */
+#define CAP_LEDS    2     /* LED command bytes */
+#define CAP_TAPS    3     /* byte: buttons tapped between 2 samples */
+#define CAP_PORTS   4     /* byte: number of ports */
+
+typedef struct Port Port;
+
+/* Access to the modem lines: the serial port or the simulator of -S. */
+typedef struct Lines {
+	int (*open)(Port *p);
+	int (*get)(Port *p, int *data);
+	int (*set)(Port *p, int data);
+	int (*set_txd)(Port *p, int high);
+	int (*watch)(Port *p);   /* starts to signal button edges to waitFd */
+} Lines;
+
+typedef struct SimEvent {
+	int ms;           /* since start of the script */
+	int type;
+	int value;
+	int scenario;
+} SimEvent;
+
+typedef struct Latency {
+	int nb;
+	double sum, min, max;  /* ms */
+} Latency;
+
+typedef struct Scenario {
+	char *name;
+	Latency edge;     /* button edge -> byte on stdout */
+	Latency led;      /* LED command -> line change */
+} Scenario;
+
+typedef struct Sim {
+	SimEvent *events;
+	int eventNb;
+	int next;
+	Scenario *scenarios;
+	int scenarioNb;
+	int timer;
+	struct timespec start;
+	int lines;        /* simulated modem lines */
+	int txd;
+	int edgeScenario; /* scenario of the edge waiting for output, -1 if none */
+	struct timespec edgeAt;
+	int ledScenario;  /* scenario of the LED command waiting for a line change */
+	struct timespec ledAt;
+} Sim;
+
+/* Debounce state of the 4 buttons, one bit per button. */
+typedef struct Debounce {
+	unsigned char state;     /* reported */
+	unsigned char pending;   /* differ from state, not stable long enough */
+	unsigned char last;      /* buttons of the last sample */
+	uint64_t since[4];       /* ns, time a pending button was first seen */
+	uint64_t lastAt;         /* ns, time of the last sample */
+} Debounce;
+
+/* interrupt counters of the button lines, see read_lines() */
+typedef struct Icount {
+	int usable;       /* TIOCGICOUNT works on the port */
+	int valid;        /* last holds a result */
+	struct serial_icounter_struct last;
+} Icount;
+
+/* handed over by the sampling thread of -T */
+typedef struct Sample {
+	int data;         /* TIOCMGET result, -1 on errors */
+	int dropped;      /* samples before this one lost as the ring was full */
+	unsigned char taps;
+	unsigned char skipped; /* lines unchanged, data is the last result */
+	struct timespec at;
+} Sample;
+
+/* One serial port with its 4 buttons and 2 LED groups. */
+struct Port {
+	int nr;
+	char *path;
+	int fd;
+
+	int waitMode;     /* 1: wait for edges with TIOCMIWAIT, 0: poll */
+	int waitFd;       /* eventfd, signaled by the waiter thread */
+	int waitErr;      /* errno of a failed TIOCMIWAIT, 0 if none, atomic */
+	int settleLoops;  /* loops to keep polling after an edge */
+	int inputBusy;    /* debounce window of serIn_to_stdout() open */
+	int lineData;     /* last TIOCMGET result */
+	Icount icount;
+	unsigned char taps; /* buttons tapped between the last 2 samples */
+	Debounce debounce;
+
+	int sampleTimer;  /* polling interval while sampling */
+	int sampling;     /* ms of the sample timer, 0: stopped */
+	int quietSamples; /* polled samples without a change at this interval */
+	unsigned long pollWakeups;
+	struct timespec pollStart;
+	struct timespec pollLast;
+	int ledTimer[2];  /* of the 2 LED groups */
+	int ledMode[2];
+	int ledModeOld[2];
+	int ledStat[2];
+	int ledStatOld[2];
+	int ledsSet;      /* LED states written at least once */
+
+	Ring *ring;       /* samples of the thread of -T */
+	pthread_t thread; /* of -T or the TIOCMIWAIT waiter, never both */
+	int threadRunning;
+};
+
 typedef struct Settings {        
-	char *serPortPath;
-	int port;
+	char **paths;
+	int portNb;
+	Port port[PORTS_MAX];
+	Lines *lines;
+	char *simPath;
+	Sim *sim;
+	char *replayPath;
+	int replaySpeed;
 	int delay;
-	int *loopsOut;
+	int *blinkMs;     /* half period of blink modes 2-8 in ms */
 	int loopsIn;
+	int idleMs;       /* longest polling interval without TIOCMIWAIT */
+	int pressMs;      /* a pressed button has to be stable that long */
+	int releaseMs;    /* a released button has to be stable that long */
 	int testmode;
+	int waitMode;     /* -P not given */
+	int threaded;     /* sample in a thread of its own (-T) */
+
+	int tagByte;      /* port number sent as extra byte before the buttons */
+	unsigned char outState; /* buttons of all ports, 4 bits each */
+	int ledPort;      /* port of the LED commands, -1: all */
+
+	int statHandoff;
+	int statRingFull;
+
+	int statEdges;
+	int statSamples;
+	int statDebounced; /* changes that didn't last the debounce time */
+	int statOut;
+	int statLedCmds;
+	int statBacklog;   /* reads of more than 10 LED commands */
+	int statPollInterval; /* us between 2 polled samples */
+	int statTaps;      /* taps seen only by the interrupt counters */
+	int statSkipped;   /* samples without TIOCMGET */
 	
 } Settings;
 
 
 static Settings *settings = NULL;
 
+/* delay, loopsIn, pressMs and releaseMs: written on SIGHUP, read by the
+ * threads of -T */
+static pthread_mutex_t timingLock = PTHREAD_MUTEX_INITIALIZER;
+
+static Lines portLines, simLines, replayLines;
+
+
+static void free_port(Port *p) {
+
+	if (p->pollWakeups > 1) {
+		double s = (p->pollLast.tv_sec - p->pollStart.tv_sec)
+					+ (p->pollLast.tv_nsec - p->pollStart.tv_nsec) / 1e9;
+		info("Polled the button lines of '%s' %lu times in %.1f s, %.1f wakeups/s on average.",
+				p->path, p->pollWakeups, s, s > 0 ? (p->pollWakeups - 1) / s : 0.);
+	}
+
+	if (p->threadRunning) {
+		pthread_cancel(p->thread);
+		pthread_join(p->thread, NULL);
+	}
+	ring_free(p->ring);
+
+	if (p->fd >= 0)
+		close(p->fd);
+
+	if (p->waitFd >= 0)
+		close(p->waitFd);
+}
+
 
 static void free_settings() {
 	
 	if (settings == NULL)
 		return;
 
-	if (settings->loopsOut == NULL)
-		free(settings->loopsOut);
+	int i;
+	for (i = 0; i < settings->portNb; i++)
+		free_port(&settings->port[i]);
+	free(settings->paths);
+
+	if (settings->blinkMs != NULL)
+		free(settings->blinkMs);
 
-	if (settings->port >= 0) {
-		close(settings->port);
+	if (settings->sim != NULL) {
+		for (i = 0; i < settings->sim->scenarioNb; i++)
+			free(settings->sim->scenarios[i].name);
+		free(settings->sim->scenarios);
+		free(settings->sim->events);
+		free(settings->sim);
 	}
-	
+
 	free(settings);
 	settings = NULL;
 }
 
+#ifndef CTRL_MULTI
+
 static void my_exit(int retVal) {
 	
 	free_settings();
+	cap_close();
+	loop_free();
+	free_output();
 	info("Exit.");
 	exit(retVal);
 }
@@ -92,16 +301,108 @@ static void print_info() {
     printf("options:\n");
     printf("  -h              help (this info)\n");
     printf("  -p <path>       path of serial port (e.g. '/dev/tyyS0')\n");
-    printf("                  NOT optional\n");
+    printf("                  NOT optional, unless -S or -R is given\n");
+    printf("                  Up to %d ports may be given comma separated, e.g.\n", PORTS_MAX);
+    printf("                  '-p /dev/ttyS0,/dev/ttyUSB0'. Then the buttons of port\n");
+    printf("                  <n> are bits 4<n> to 4<n>+3 of the byte (2 ports at\n");
+    printf("                  most, without -G), and the LED command %d+<n> makes\n", LED_SELECT);
+    printf("                  the following commands go to port <n> only, %d to\n", LED_SELECT_ALL);
+    printf("                  all ports again (the default)\n");
+    printf("  -G              send the number of the port as extra byte before\n");
+    printf("                  every byte of its 4 buttons. The default of -o is\n");
+    printf("                  'oldest' then, 'coalesce' is not allowed\n");
+    printf("  -S <script>     simulate the modem lines instead of using a serial port:\n");
+    printf("                  replay the script and report the latencies per scenario.\n");
+    printf("                  Script lines: 'scenario <name>', '<ms> buttons <bits>'\n");
+    printf("                  or '<ms> led <command>', <ms> counted from the start\n");
+    printf("  -r <file>       record the button lines and the LED commands to <file>\n");
+    printf("  -R <file>       replay a file of -r instead of using a serial port\n");
+    printf("  -x <speed>      speed factor of -R, 0: as fast as possible. Default: 1\n");
     printf("  -t              testmode\n");
     printf("  -d <delay>      interval between polling 2 loops in milliseconds, default: 10\n");
-    printf("  -b <number>     number of polling loops a button state has to be\n");
-    printf("                  consant to be regarded. Default: 4\n");
-    printf("  -[2-8] <number> number of polling loops a LED in blink mode 2 -8 keeps in\n");
-	printf("                  constant state\n");
+    printf("  -T              sample the button lines in a thread of its own, so\n");
+    printf("                  sampling never waits for stdout or the LED commands\n");
+    printf("  -P              always poll the modem lines, even if the driver\n");
+    printf("                  supports waiting for edges (TIOCMIWAIT)\n");
+    printf("  -D <ms>         longest polling interval without TIOCMIWAIT: the lines\n");
+    printf("                  are polled every <delay> ms while they change, then\n");
+    printf("                  the interval doubles up to <ms>. Default: 100\n");
+    printf("  -b <number>     number of polling loops after an edge. Default: 4\n");
+    printf("  -e <ms>         time a pressed button has to be stable to be regarded,\n");
+    printf("                  0: at once. Default: (<number> - 1) * <delay>\n");
+    printf("  -E <ms>         the same for a released button\n");
+    printf("  -[2-8] <number> number of polling loops (of <delay> ms) a LED in blink\n");
+	printf("                  mode 2 - 8 keeps in constant state.\n");
+	printf("                  Defaults: 100 61 37 22 14 8 5\n");
+    printf("  -c <file>       config file with further options, read again on SIGHUP.\n");
+    printf("                  -b, -d, -D, -e, -E and -[2-8] change while running.\n");
+    printf("  -o <policy>     what to do if stdout is not read fast enough and the\n");
+    printf("                  queue is full: 'oldest' or 'newest' (drop events),\n");
+    printf("                  'coalesce' (keep the latest state) or 'block'.\n");
+    printf("                  Default: coalesce, with -G oldest\n");
+    printf("  -q <bytes>      size of the stdout queue. Default: 4096\n");
+    printf("\n");
+    printf("SIGUSR1 logs runtime statistics.\n");
     printf("\n");
 }
 
+#endif
+
+
+/* Reads the options that may change on SIGHUP, see reload_settings(). */
+static int get_timing_opts(int *blinkMs, int *delay, int *loopsIn, int *idleMs, 
+							int *pressMs, int *releaseMs) {
+
+	if (	!get_opt_int_between('d', 1, 1, 1000, 10, delay)
+		||	!get_opt_int_between('b', 1, 1, 1000, 4, loopsIn)
+		||	!get_opt_int_between('D', 1, 1, 60000, 100, idleMs)) {
+
+		return 0;
+	}
+
+	/* blink modes are given in loops of <delay> ms, as before the timers */
+	int i, loops;
+	for (i = 0; i < 7; i++) {
+		if (!get_opt_int_between('2'+i, 1, 0, 1000, round(5 * pow(20.,1.*(6-i)/6)), &loops))
+			return 0;
+		blinkMs[i] = loops > 0 ? loops * *delay : 1;
+	}
+	if (*idleMs < *delay)
+		*idleMs = *delay;
+
+	/* the time <loopsIn> samples took before */
+	int dflt = (*loopsIn - 1) * *delay;
+	return	get_opt_int_between('e', 1, 0, 60000, dflt, pressMs)
+		&&	get_opt_int_between('E', 1, 0, 60000, dflt, releaseMs);
+}
+
+
+static void init_port(Port *p, int nr, char *path) {
+
+	memset(p, 0, sizeof(Port));
+	p->nr = nr;
+	p->path = path;
+	p->fd = -1;
+	p->waitMode = settings->waitMode;
+	p->waitFd = -1;
+	p->inputBusy = 1;
+	p->icount.usable = 1;
+	p->sampleTimer = -1;
+	p->ledTimer[0] = -1;
+	p->ledTimer[1] = -1;
+}
+
+
+/* More than 2 ports don't fit in one byte. */
+static int check_port_nb() {
+
+	if (settings->portNb > 2 && !settings->tagByte) {
+		error("Option '-G' is needed for more than 2 ports.");
+		return 0;
+	}
+	return 1;
+}
+
 
 static int init_settings() {
    
@@ -111,28 +412,85 @@ static int init_settings() {
 		return 0;
 	}
 
-	settings->loopsOut = malloc(7*sizeof(int));
-    if (settings->loopsOut == NULL) {
+	settings->paths = NULL;
+	settings->portNb = 0;
+	settings->sim = NULL;
+
+	settings->blinkMs = malloc(7*sizeof(int));
+    if (settings->blinkMs == NULL) {
 		noMem();
 		return 0;
 	}
-	int i;
-	for (i = 0; i < 7; i++) 
-		if (!get_opt_int_between('2'+i, 1, 0, 1000, round(5 * pow(20.,1.*(6-i)/6)), &settings->loopsOut[i]))
-			return 0;
 
-    settings->serPortPath = NULL;
-	settings->port = -1;
 	settings->delay = 10;
 	settings->loopsIn = 4;
 	settings->testmode = 0;
+	settings->waitMode = get_opt_str('P', 0, NULL) ? 0 : 1;
+	settings->tagByte = get_opt_str('G', 0, NULL);
+	settings->outState = 0;
+	settings->ledPort = -1;
+	settings->threaded = get_opt_str('T', 0, NULL);
+	settings->statHandoff = stat_histogram("serial handoff");
+	settings->statRingFull = stat_counter("serial ring full");
+	settings->statEdges = stat_counter("serial edges");
+	settings->statSamples = stat_counter("serial samples");
+	settings->statDebounced = stat_counter("serial debounced");
+	settings->statOut = stat_counter("serial out");
+	settings->statLedCmds = stat_counter("serial LED commands");
+	settings->statBacklog = stat_counter("serial stdin backlog");
+	settings->statPollInterval = stat_histogram("serial poll interval");
+	settings->statTaps = stat_counter("serial taps between samples");
+	settings->statSkipped = stat_counter("serial samples without TIOCMGET");
 	    
-	if (!get_opt_str('p', 1, &settings->serPortPath))
+	settings->simPath = NULL;
+	settings->replayPath = NULL;
+	settings->lines = &portLines;
+	char *portStr;
+	int i, nb = 1;
+
+	if (get_opt_str('S', 0, &settings->simPath)) {
+		settings->lines = &simLines;
+		if (settings->threaded) {
+			error("Option '-T' can't be used with '-S'.");
+			return 0;
+		}
+	} else if (get_opt_str('R', 0, &settings->replayPath)) {
+		/* the number of ports comes with the records */
+		nb = PORTS_MAX;
+		settings->lines = &replayLines;
+		settings->threaded = 0;
+		settings->waitMode = 0;
+		if (!get_opt_int_between('x', 1, 0, 1000, 1, &settings->replaySpeed))
+			return 0;
+	} else if (!get_opt_str('p', 1, &portStr)) {
 		return 0;
+	} else {
+		nb = split_str(portStr, ',', &settings->paths);
+		if (nb < 1 || nb > PORTS_MAX) {
+			error("Option '-p' needs 1 to %d paths.", PORTS_MAX);
+			return 0;
+		}
+	}
+
+	for (i = 0; i < nb; i++) {
+		char *path = settings->paths != NULL ? settings->paths[i] 
+					: settings->simPath != NULL ? settings->simPath : settings->replayPath;
+		init_port(&settings->port[i], i, path);
+		settings->portNb++;
+	}
+	if (settings->replayPath == NULL && !check_port_nb())
+		return 0;
+
+	char *capPath;
+	if (get_opt_str('r', 0, &capPath)) {
+		unsigned char portNb = settings->portNb;
+		if (!cap_open(capPath))
+			return 0;
+		cap_write(CAP_PORTS, &portNb, 1);
+	}
 	
-	if (	!get_opt_int_between('d', 1, 1, 1000, settings->delay, &settings->delay)
-		||  !get_opt_int_between('b', 1, 1, 1000, settings->loopsIn, &settings->loopsIn)){
-	
+	if (!get_timing_opts(settings->blinkMs, &settings->delay, &settings->loopsIn,
+						&settings->idleMs, &settings->pressMs, &settings->releaseMs)) {
 		return 0;
 	}
 		
@@ -143,275 +501,1378 @@ static int init_settings() {
 }
 
 
-static int open_serial_port() {
-    settings->port = open(settings->serPortPath, O_RDWR | O_NOCTTY | O_NONBLOCK | O_SYNC );
-    if (settings->port == -1) {
+static int open_serial_port(Port *p) {
+    p->fd = open(p->path, O_RDWR | O_NOCTTY | O_NONBLOCK | O_SYNC );
+    if (p->fd == -1) {
 		int err = errno;
         error("Can't open serial port '%s': %s.", 
-				settings->serPortPath, strerror(err));
+				p->path, strerror(err));
         return 0;
     }
     return 1;
 }
 
 
-static int get_serial_data(int *serData) {
-	int data = 0;
-    if (ioctl(settings->port, TIOCMGET, &data)==-1) {
-        error("Can't read from serial port '%s' (TIOCMGET).",settings->serPortPath);
-        return 0;
-    }
-    *serData = data;
-    return 1;
+/* Reads the modem lines into *data. With TIOCGICOUNT, TIOCMGET is skipped
+ * while the counters of the button lines didn't move (returns 2, *data is
+ * kept), and buttons whose line changed at least twice but looks the same
+ * are set in *taps: a tap between 2 samples. The 8250 driver counts only
+ * the trailing edge of RNG, so the skip needs RNG set in the last result
+ * and one count on RNG is a tap. Returns 0 on errors.
+ * Also called by the thread of -T, with an Icount of its own. */
+static int read_lines(Port *p, Icount *ic, int *data, unsigned char *taps) {
+
+	struct serial_icounter_struct now;
+	*taps = 0;
+
+	if (ic->usable && ioctl(p->fd, TIOCGICOUNT, &now) == -1)
+		ic->usable = 0;
+
+	if (	ic->usable && ic->valid && (*data & TIOCM_RNG)
+		&&	now.rng == ic->last.rng && now.cts == ic->last.cts 
+		&&	now.dsr == ic->last.dsr && now.dcd == ic->last.dcd) {
+
+		return 2;
+	}
+
+	int old = *data;
+	if (ioctl(p->fd, TIOCMGET, data) == -1)
+		return 0;
+
+	if (ic->usable) {
+		if (ic->valid) {
+			/* in the order of buttonPins */
+			int moved[4] = { 2 * (now.rng - ic->last.rng), now.cts - ic->last.cts, 
+							 now.dsr - ic->last.dsr, now.dcd - ic->last.dcd };
+			int i;
+			for (i = 0; i < 4; i++)
+				if (moved[i] >= 2 && !((old ^ *data) & buttonPins[i]))
+					*taps |= 1 << i;
+		}
+		ic->last = now;
+		ic->valid = 1;
+	}
+	return 1;
+}
+
+
+static int get_serial_data(Port *p, int *serData) {
+
+	int usable = p->icount.usable;
+	int r = read_lines(p, &p->icount, serData, &p->taps);
+	if (r == 0) {
+		error("Can't read from serial port '%s' (TIOCMGET).",p->path);
+		return 0;
+	}
+	if (usable && !p->icount.usable && settings->testmode)
+		info("TIOCGICOUNT not usable on '%s' - taps between 2 samples may be missed.",
+				p->path);
+	if (r == 2)
+		stat_add(settings->statSkipped, 1);
+	return 1;
 }
 
 
-static int set_serial_data(int data) {
-    if (ioctl(settings->port, TIOCMSET, &data)==-1) {
-        error("Can't write to serial port '%s' (TIOCMSET).",settings->serPortPath);
+static int set_serial_data(Port *p, int data) {
+    if (ioctl(p->fd, TIOCMSET, &data)==-1) {
+        error("Can't write to serial port '%s' (TIOCMSET).",p->path);
         return 0;
     }
     return 1;
 }
 
 
-static int set_txd(int high) {
+static int set_txd(Port *p, int high) {
 	
 	int tio = high ? TIOCSBRK : TIOCCBRK;
-    if (ioctl(settings->port, tio, NULL ) ==-1) {
-        error("Can't write to serial port '%s' (%s).",settings->serPortPath,high ? "TIOCSBRK" : "TIOCCBRK");
+    if (ioctl(p->fd, tio, NULL ) ==-1) {
+        error("Can't write to serial port '%s' (%s).",p->path,high ? "TIOCSBRK" : "TIOCCBRK");
         return 0;
     }	
     return 1;
 }
 
-static int serIn_to_stdout(int data) {
+/* Runs in its own thread, one per port: blocks in TIOCMIWAIT until one
+ * of the button lines changes and wakes up the main loop through the
+ * waitFd of the port. If the driver doesn't support TIOCMIWAIT the error
+ * is handed over to the main loop, which falls back to polling. It is
+ * cancelled only while waiting, like the thread of -T. */
+static void * wait_for_edges(void *arg) {
 
-	static int pins[] = { TIOCM_RNG, TIOCM_CTS, TIOCM_DSR,  TIOCM_CD };
-    static unsigned char old = 0;
-    static unsigned char  oldSent = 0;
-    static int cnt = 0;
-	static struct pollfd pfd = {1,POLLOUT,0};
+	Port *p = arg;
+	uint64_t one = 1;
 
-	unsigned char val = 0;
-	int i = 0;
-	
-	for (i = 0; i < 4; i++) {
-		if (data  & pins[i]) 
-			val |= (1<<i);
-	}
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
 
-	/* invert */
-	val ^= (data & TIOCM_DTR ? 0x0F : 0);
-	
-	if (val == old) {
-		
-		int d = cnt + 1 - settings->loopsIn;
-		if (d <= 0) 
-			cnt++;
-		if (d == 0 && oldSent != val) {
-			
-			if (!settings->testmode) {
-				if ( (poll(&pfd, 1, 0)<=0 )
-					 || ((pfd.revents & POLLOUT) == 0 )
-					 || (write(1, &val, 1) != 1)) {
-						 
-					error("Can't write unsigned char '0x%02X' to stdout",val);
-					return 0;
-				}
-			} else {
-				printf("Buttons: %s\n",get_multi_base_str(val));
-			}
-								
-			oldSent = val;
+	while (1) {
+		/* ioctl() is no cancellation point */
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+		pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, NULL);
+		int res = ioctl(p->fd, TIOCMIWAIT, BUTTON_PINS);
+		int err = errno;
+		pthread_setcanceltype(PTHREAD_CANCEL_DEFERRED, NULL);
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+		if (res == -1) {
+			if (err == EINTR)
+				continue;
+			__atomic_store_n(&p->waitErr, err, __ATOMIC_RELEASE);
+			write(p->waitFd, &one, sizeof(one));
+			return NULL;
 		}
-	} else {
-		cnt = 0;
-		old = val;
+		if (write(p->waitFd, &one, sizeof(one)) != sizeof(one))
+			return NULL;
+	}
+}
+
+
+static int start_edge_waiter(Port *p) {
+
+	/* the waiter must not take the signals from the main loop */
+	sigset_t all, old;
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+
+	int err = pthread_create(&p->thread, NULL, wait_for_edges, p);
+
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	if (err != 0) {
+		error("Can't start TIOCMIWAIT thread: %s.", strerror(err));
+		return 0;
 	}
+	p->threadRunning = 1;
 	return 1;
 }
 
 
-static int stdin_to_serOut(int data) {
+static Lines portLines = { 
+	open_serial_port, get_serial_data, set_serial_data, set_txd, start_edge_waiter 
+};
 
-	static int firstRun = 1;
-	static int serOutStat[] = {0,0};
-	static int serOutStatOld[] = {0,0};
-	static int serOutMode[] = {0,0};
-	static int cntOut[] = {0,0};
-	static struct pollfd pfd = {0,POLLIN,0};
 
-	int bufSize = 100;
-	unsigned char buf [bufSize];
-	
-	int i,j;
+static double ms_since(const struct timespec *t) {
 
-	if (firstRun && settings->testmode) {
-		
-		printf("\nTest mode - %s\n\n",RELEASE);
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - t->tv_sec) * 1e3 + (now.tv_nsec - t->tv_nsec) / 1e6;
+}
 
-		for (i = 0; i < 7; i++)
-			printf("loopsout[%d]: %d\n",i+2,settings->loopsOut[i]);
 
-		printf("\n");
+static void add_latency(Latency *l, const struct timespec *since) {
 
-		for (i = 0; i < 2; i++)
-			printf("mode LED %d: %d\n",i,serOutMode[0]);
-		
-		printf("\nPlease press a button connected to the serial port\n");
-		printf("or enter 1-2 digits followed by the Return key.\n\n");
-	}
-	
-	int nbIn  = 0;
-	
-	if (poll(&pfd, 1, 0)>0 && (pfd.revents & POLLIN))
-		nbIn = read(0, buf, bufSize);	
-		
-	if (nbIn < 0)
-		return 0;
-	
-	if (nbIn>0 && settings->testmode) {
-		
-		int ignore = 0;
-		
-		if (nbIn >= 2 && nbIn <= 3 && buf[nbIn-1] == '\n') {
-			unsigned char tmp = 0;									
-			for (i = 0; i< nbIn-1; i++) {
-				if (buf[i] >= '0' && buf[i] <= '9')
-					tmp = 10 * tmp + (buf[i] - '0');
-				else 
-					ignore = 1;
-			}
-			if (!ignore) {
-				buf[0] = tmp;
-				nbIn = 1;
-			}
-		} else {
-			ignore = 1;
-		}	
-		if (ignore)	{
-			info("ignored:");
-			for (i = 0; i< nbIn; i++) 
-				if (buf[i]>= 0x20 && buf[i]< 0x7F)
-					info("%d: 0x%02x '%c')", i, buf[i], buf[i]);
-				else
-					info("%d: 0x%02x)", i, buf[i]);
-			nbIn = 0;
-		}
-	}
-	
-	if (nbIn > 10)
-		error("Found at least %d bytes in stdin. => May read slower than writer writes.",nbIn);
-	
-	int newMode[] = {0,0}; 
+	double ms = ms_since(since);
+	if (l->nb == 0 || ms < l->min)
+		l->min = ms;
+	if (l->nb == 0 || ms > l->max)
+		l->max = ms;
+	l->sum += ms;
+	l->nb++;
+}
 
-	for (i = 0; i < nbIn; i++) {
-		
-		newMode[0] = buf[i] % 10;
-		newMode[1] = (buf[i]/10) % 10;
-	
-		for (j = 0; j < 2; j++) {
-			if (newMode[j] != 9) {
-				if (serOutMode[j] != newMode[j] && settings->testmode) 
-					info("LED %d set to mode %d.",j,newMode[j]);
-				serOutMode[j] = newMode[j];
-			}
-		}
-	} 
 
-	/* sync led f same mode */
-	if (serOutMode[0] == serOutMode[1]) {
-		serOutStat[0] = serOutStat[1];
-		
-		if (cntOut[0] > cntOut[1]) 
-			cntOut[0] = cntOut[1];
-		else
-			cntOut[1] = cntOut[0];
-	}
-	
-	for (i = 0; i < 2; i++) {
+static void report_latency(const char *what, Latency *l) {
 
-		if (serOutMode[i] == 0) {
-			cntOut[i] = 0;
-			serOutStat[i] = 0;
-		}
-		
-		if (serOutMode[i] == 1) {
-			cntOut[i] = 0;
-			serOutStat[i] = 1;
-		}
+	if (l->nb == 0)
+		info("  %s: none", what);
+	else
+		info("  %s: %d, min %.3f ms, avg %.3f ms, max %.3f ms", 
+				what, l->nb, l->min, l->sum / l->nb, l->max);
+}
 
-		if (serOutMode[i] >= 2 && serOutMode[i] <= 8) {
-			if (cntOut[i] < settings->loopsOut[serOutMode[i]-2])
-				cntOut[i]++;
-			else {
-				cntOut[i] = 0;
-				serOutStat[i] = 1-serOutStat[i];
-			}
-		}
-	}	
-	
-	int res = 1;
-	
-	for (i = 0; i<2; i++) {
-		if (firstRun || serOutStat[i] != serOutStatOld[i]) {
-			serOutStatOld[i] = serOutStat[i];
 
-			if (i==0) {
-				if (serOutStat[0]) {
-					data |= TIOCM_DTR; 
-					data &= ~TIOCM_RTS;
-				} else {
-					data &= ~TIOCM_DTR;
-					data |= TIOCM_RTS;
-				}
-				if (!set_serial_data(data))
-					res = 0;
-			}
-			
-			if (i==1 && !set_txd(serOutStat[1]))
-				res = 0;
-		}
-	}
+/* Called when the debounced button state was taken (sent = 1) or found
+ * unchanged (sent = 0), which ends the latency of a simulated edge. */
+static void sim_edge_done(int sent) {
 
-	firstRun = 0;
-	return res;
+	Sim *sim = settings->sim;
+	if (sim == NULL || sim->edgeScenario < 0)
+		return;
+	if (sent)
+		add_latency(&sim->scenarios[sim->edgeScenario].edge, &sim->edgeAt);
+	sim->edgeScenario = -1;
 }
 
 
-int main(int argc, char *argv[]){
-	
-	if (!init_util(PROG, argc, argv, ":b:d:hp:t2:3:4:5:6:7:8:"))
-		my_exit(EXIT_FAILURE);
-    
-    if (get_opt_str('h', 0, NULL)) {
-		print_info();
-		my_exit(EXIT_SUCCESS);
-	}
+static void sim_line_changed() {
 
-	if (	!init_settings()
-		||  !open_serial_port()) {
-		
-		my_exit(EXIT_FAILURE);
-	}
-	
-	int data;
-	
-    while (1) {
+	Sim *sim = settings->sim;
+	if (sim->ledScenario >= 0)
+		add_latency(&sim->scenarios[sim->ledScenario].led, &sim->ledAt);
+	sim->ledScenario = -1;
+}
+
+
+static int sim_get(Port *p, int *data) {
+	*data = settings->sim->lines;
+	return 1;
+}
+
+
+static int sim_set(Port *p, int data) {
+
+	Sim *sim = settings->sim;
+	sim->lines = (sim->lines & BUTTON_PINS) | (data & ~BUTTON_PINS);
+	sim_line_changed();
+	return 1;
+}
+
+
+static int sim_set_txd(Port *p, int high) {
+	settings->sim->txd = high;
+	sim_line_changed();
+	return 1;
+}
 
-		if (	!get_serial_data(&data)
-			||	!serIn_to_stdout(data)
-			||	!stdin_to_serOut(data)) {
-					
-			my_exit(EXIT_FAILURE);
-		}
 
-		if (stopped_by_signal())
-			my_exit(EXIT_SUCCESS);
+/* Edges are signaled by sim_apply() itself. */
+static int sim_watch(Port *p) {
+	return 1;
+}
+
+
+static int add_sim_scenario(Sim *sim, const char *name) {
 
-		usleep(settings->delay*1000);
+	Scenario *s = realloc(sim->scenarios, (sim->scenarioNb + 1) * sizeof(Scenario));
+	if (s == NULL) {
+		noMem();
+		return 0;
 	}
-	
-	return EXIT_FAILURE;
+	sim->scenarios = s;
+	s += sim->scenarioNb;
+	memset(s, 0, sizeof(Scenario));
+	s->name = strdup(name);
+	if (s->name == NULL) {
+		noMem();
+		return 0;
+	}
+	sim->scenarioNb++;
+	return 1;
 }
+
+
+static int add_sim_event(Sim *sim, int ms, int type, int value) {
+
+	if (sim->scenarioNb == 0 && !add_sim_scenario(sim, "default"))
+		return 0;
+
+	SimEvent *e = realloc(sim->events, (sim->eventNb + 1) * sizeof(SimEvent));
+	if (e == NULL) {
+		noMem();
+		return 0;
+	}
+	sim->events = e;
+	e += sim->eventNb++;
+	e->ms = ms;
+	e->type = type;
+	e->value = value;
+	e->scenario = sim->scenarioNb - 1;
+	return 1;
+}
+
+
+/* Reads the script of -S. Lines are 'scenario <name>', '<ms> buttons <bits>'
+ * or '<ms> led <command>' with non decreasing <ms>. '#' starts a comment. */
+static int read_sim_script(Sim *sim) {
+
+	FILE *file = fopen(settings->simPath, "r");
+	if (file == NULL) {
+		int err = errno;
+		error("Can't open script '%s': %s.", settings->simPath, strerror(err));
+		return 0;
+	}
+
+	char *line = NULL;
+	size_t size = 0;
+	int lineNb = 0;
+	int lastMs = 0;
+	int ok = 1;
+
+	while (ok && getline(&line, &size, file) >= 0) {
+
+		lineNb++;
+		char *hash = strchr(line, '#');
+		if (hash != NULL)
+			*hash = '\0';
+
+		char word[32], name[64];
+		int ms, value;
+		if (sscanf(line, " %63s", name) != 1)
+			continue;
+
+		if (strcmp(name, "scenario") == 0) {
+			if (sscanf(line, " scenario %63s", name) != 1) {
+				ok = 0;
+			} else {
+				ok = add_sim_scenario(sim, name);
+				continue;
+			}
+		} else if (sscanf(line, "%d %31s %i", &ms, word, &value) != 3 || ms < lastMs) {
+			ok = 0;
+		} else if (strcmp(word, "buttons") == 0 && value >= 0 && value <= 0x0F) {
+			ok = add_sim_event(sim, ms, SIM_BUTTONS, value);
+		} else if (strcmp(word, "led") == 0 && value >= 0 && value <= 0xFF) {
+			ok = add_sim_event(sim, ms, SIM_LED, value);
+		} else {
+			ok = 0;
+		}
+		if (!ok)
+			error("Line %d of script '%s' is invalid.", lineNb, settings->simPath);
+		else
+			lastMs = ms;
+	}
+	free(line);
+	fclose(file);
+
+	if (ok && sim->eventNb == 0) {
+		error("Script '%s' has no events.", settings->simPath);
+		ok = 0;
+	}
+	return ok;
+}
+
+
+/* Absolute time of <ms> after the start of the script. */
+static void sim_time(Sim *sim, int ms, struct timespec *at) {
+
+	*at = sim->start;
+	at->tv_sec += ms / 1000;
+	at->tv_nsec += (ms % 1000) * 1000000L;
+	if (at->tv_nsec >= 1000000000L) {
+		at->tv_sec++;
+		at->tv_nsec -= 1000000000L;
+	}
+}
+
+
+static int arm_sim_timer(Sim *sim, int ms) {
+
+	struct timespec at;
+	sim_time(sim, ms, &at);
+	return loop_set_timer_at(sim->timer, &at, 0);
+}
+
+
+static int set_led_modes(const unsigned char *buf, int nb);
+
+/* Applies the script events that are due, at their deadlines. The
+ * scheduled time is taken as the time of the line change, so the
+ * latencies include the wakeup of the loop. */
+static int sim_apply(int timer, uint64_t exp, void *data) {
+
+	Sim *sim = settings->sim;
+	int i;
+
+	if (sim->next == sim->eventNb) {
+		for (i = 0; i < sim->scenarioNb; i++) {
+			info("Scenario '%s':", sim->scenarios[i].name);
+			report_latency("button edge -> stdout", &sim->scenarios[i].edge);
+			report_latency("LED command -> line  ", &sim->scenarios[i].led);
+		}
+		loop_stop();
+		return 1;
+	}
+
+	int ms = sim->events[sim->next].ms;
+
+	while (sim->next < sim->eventNb && sim->events[sim->next].ms == ms) {
+
+		SimEvent *e = &sim->events[sim->next++];
+		struct timespec at;
+		sim_time(sim, e->ms, &at);
+
+		if (e->type == SIM_BUTTONS) {
+			int lines = sim->lines & ~BUTTON_PINS;
+			for (i = 0; i < 4; i++)
+				if (e->value & (1<<i))
+					lines |= buttonPins[i];
+			if (lines == sim->lines)
+				continue;
+			sim->lines = lines;
+			sim->edgeScenario = e->scenario;
+			sim->edgeAt = at;
+			uint64_t one = 1;
+			Port *p = &settings->port[0];
+			if (p->waitMode && write(p->waitFd, &one, sizeof(one)) != sizeof(one))
+				return 0;
+		} else {
+			unsigned char cmd = e->value;
+			sim->ledScenario = e->scenario;
+			sim->ledAt = at;
+			if (!set_led_modes(&cmd, 1))
+				return 0;
+			/* the command didn't change a line, e.g. a blink mode */
+			sim->ledScenario = -1;
+		}
+	}
+
+	if (sim->next < sim->eventNb)
+		return arm_sim_timer(sim, sim->events[sim->next].ms);
+	return arm_sim_timer(sim, ms + SIM_TAIL_MS);
+}
+
+
+/* -S simulates 1 port. */
+static int sim_open(Port *p) {
+
+	Sim *sim = calloc(1, sizeof(Sim));
+	if (sim == NULL) {
+		noMem();
+		return 0;
+	}
+	settings->sim = sim;
+	sim->edgeScenario = -1;
+	sim->ledScenario = -1;
+
+	if (!read_sim_script(sim))
+		return 0;
+
+	sim->timer = loop_add_timer(sim_apply, NULL);
+	if (sim->timer < 0)
+		return 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &sim->start);
+	return arm_sim_timer(sim, sim->events[0].ms);
+}
+
+
+static Lines simLines = { sim_open, sim_get, sim_set, sim_set_txd, sim_watch };
+
+
+/* Writes the 4 buttons of a port: with -G after the number of the port,
+ * otherwise as bits 4<nr> to 4<nr>+3 of the buttons of all ports. */
+static int write_buttons(Port *p, unsigned char val) {
+
+	if (!settings->testmode) {
+		unsigned char buf[2];
+		int nb = 0;
+		if (settings->tagByte) {
+			buf[nb++] = p->nr;
+			buf[nb++] = val;
+		} else {
+			int shift = 4 * p->nr;
+			settings->outState = (settings->outState & ~(0x0F << shift)) | (val << shift);
+			buf[nb++] = settings->outState;
+		}
+		if (!out_write(buf, nb)) {
+			error("Can't write unsigned char '0x%02X' to stdout",buf[nb-1]);
+			return 0;
+		}
+	} else {
+		char str[MULTI_BASE_STR_LEN];
+		if (settings->portNb > 1)
+			trace("Buttons %d: %s\n",p->nr,get_multi_base_str(val, str));
+		else
+			trace("Buttons: %s\n",get_multi_base_str(val, str));
+	}
+	stat_add(settings->statOut, 1);
+	return 1;
+}
+
+
+/* Reports taps that no sample saw as a change and back, unless the
+ * button is settling anyway or the time since the last sample is below
+ * its debounce time: the tap was shorter, like chatter. at is the time
+ * of the sample that found the taps. */
+static int report_taps(Port *p, unsigned char taps, const struct timespec *at) {
+
+	Debounce *db = &p->debounce;
+	uint64_t since = at->tv_sec * 1000000000ULL + at->tv_nsec - db->lastAt;
+	int i;
+
+	taps &= ~db->pending;
+	for (i = 0; i < 4; i++) {
+		unsigned char bit = 1 << i;
+		int ms = (db->state & bit) ? settings->releaseMs : settings->pressMs;
+		if ((taps & bit) && since < ms * 1000000ULL) {
+			stat_add(settings->statDebounced, 1);
+			taps &= ~bit;
+		}
+	}
+	if (taps == 0)
+		return 1;
+
+	stat_add(settings->statTaps, __builtin_popcount(taps));
+	return write_buttons(p, db->state ^ taps) && write_buttons(p, db->state);
+}
+
+
+/* Debounces every button on its own: a change is taken once it was seen
+ * for pressMs or releaseMs since the first sample that showed it, a
+ * change that flips back before is dropped. at is the time of the sample. */
+static int serIn_to_stdout(Port *p, int data, const struct timespec *at) {
+
+	Debounce *db = &p->debounce;
+	unsigned char val = 0;
+	int i = 0;
+	
+	for (i = 0; i < 4; i++) {
+		if (data  & buttonPins[i]) 
+			val |= (1<<i);
+	}
+
+	/* invert */
+	val ^= (data & TIOCM_DTR ? 0x0F : 0);
+
+	int changed = val != db->last;
+	db->last = val;
+
+	uint64_t now = at->tv_sec * 1000000000ULL + at->tv_nsec;
+	db->lastAt = now;
+
+	unsigned char diff = val ^ db->state;
+	if (diff == 0 && db->pending == 0) {
+		p->inputBusy = changed;
+		return 1;
+	}
+
+	unsigned char back = db->pending & ~diff;
+	if (back != 0) {
+		stat_add(settings->statDebounced, __builtin_popcount(back));
+		db->pending &= ~back;
+	}
+
+	unsigned char taken = 0;
+
+	for (i = 0; i < 4; i++) {
+		unsigned char bit = 1 << i;
+		if (!(diff & bit))
+			continue;
+		if (!(db->pending & bit)) {
+			db->pending |= bit;
+			db->since[i] = now;
+		}
+		int ms = (val & bit) ? settings->pressMs : settings->releaseMs;
+		if (now - db->since[i] >= ms * 1000000ULL)
+			taken |= bit;
+	}
+	db->pending &= ~taken;
+	p->inputBusy = changed || db->pending != 0;
+
+	if (taken == 0) {
+		if (back != 0 && db->pending == 0)
+			sim_edge_done(0);
+		return 1;
+	}
+
+	db->state ^= taken;
+	if (!write_buttons(p, db->state))
+		return 0;
+	sim_edge_done(1);
+	return 1;
+}
+
+
+static int is_blink_mode(int mode) {
+	return mode >= 2 && mode <= 8;
+}
+
+
+/* Arms the blink timer of a LED group. If fromLed >= 0 the timer continues
+ * in phase with the timer of fromLed, otherwise the first toggle is one
+ * half period from now. Timers run on absolute CLOCK_MONOTONIC deadlines,
+ * so late wakeups don't accumulate. */
+static int start_blink_timer(Port *p, int led, int mode, int fromLed) {
+
+	int ms = settings->blinkMs[mode-2];
+	struct timespec at;
+
+	if (fromLed >= 0 && loop_get_timer(p->ledTimer[fromLed], &at))
+		return loop_set_timer_at(p->ledTimer[led], &at, ms);
+
+	return loop_set_timer(p->ledTimer[led], ms, ms);
+}
+
+
+static int stop_blink_timer(Port *p, int led) {
+	return loop_set_timer(p->ledTimer[led], 0, 0);
+}
+
+
+/* (Re)arms the blink timers after mode changes. LED groups in the same
+ * blink mode share the timer of LED 0. */
+static int schedule_blink(Port *p) {
+
+	int *mode = p->ledMode;
+	int *modeOld = p->ledModeOld;
+	int *stat = p->ledStat;
+
+	int changed[2] = { mode[0] != modeOld[0], mode[1] != modeOld[1] };
+	int sync = mode[0] == mode[1] && is_blink_mode(mode[0]);
+	int syncOld = modeOld[0] == modeOld[1] && is_blink_mode(modeOld[0]);
+
+	if (!changed[0] && !changed[1])
+		return 1;
+
+	if (sync) {
+		int ok;
+		if (!changed[1]) {
+			/* LED 0 joins LED 1 */
+			ok = start_blink_timer(p, 0, mode[0], 1);
+			stat[0] = stat[1];
+		} else if (!changed[0]) {
+			ok = 1;
+			stat[1] = stat[0];
+		} else {
+			ok = start_blink_timer(p, 0, mode[0], -1);
+			stat[1] = stat[0];
+		}
+		return ok && stop_blink_timer(p, 1);
+	}
+
+	int i;
+	for (i = 0; i < 2; i++) {
+		if (!is_blink_mode(mode[i])) {
+			if (changed[i] && !stop_blink_timer(p, i))
+				return 0;
+		} else if (changed[i]) {
+			if (!start_blink_timer(p, i, mode[i], -1))
+				return 0;
+		} else if (syncOld && i == 1) {
+			/* LED 0 left the shared mode, LED 1 keeps the phase */
+			if (!start_blink_timer(p, 1, mode[1], 0))
+				return 0;
+		}
+	}
+	return 1;
+}
+
+
+/* Samples the button lines every ms, 0: stops sampling. */
+static int set_sampling(Port *p, int ms) {
+
+	if (ms == p->sampling)
+		return 1;
+
+	if (!loop_set_timer(p->sampleTimer, ms, ms))
+		return 0;
+	p->sampling = ms;
+	return 1;
+}
+
+
+/* Polling without TIOCMIWAIT: every <delay> ms while the buttons change
+ * or settle. After 2 * <loopsIn> quiet samples the interval doubles, up
+ * to <idleMs>. */
+static int poll_interval(Port *p) {
+
+	if (p->inputBusy) {
+		p->quietSamples = 0;
+		return settings->delay;
+	}
+
+	int ms = p->sampling > 0 ? p->sampling : settings->delay;
+	if (++p->quietSamples < 2 * settings->loopsIn)
+		return ms;
+
+	p->quietSamples = 0;
+	return 2 * ms < settings->idleMs ? 2 * ms : settings->idleMs;
+}
+
+
+/* Writes the LED states that changed to the serial port. */
+static int set_leds(Port *p) {
+
+	int res = 1;
+	int i;
+
+	for (i = 0; i<2; i++) {
+		if (!p->ledsSet || p->ledStat[i] != p->ledStatOld[i]) {
+			p->ledStatOld[i] = p->ledStat[i];
+
+			if (i==0) {
+				int data = p->lineData;
+				if (p->ledStat[0]) {
+					data |= TIOCM_DTR; 
+					data &= ~TIOCM_RTS;
+				} else {
+					data &= ~TIOCM_DTR;
+					data |= TIOCM_RTS;
+				}
+				if (!settings->lines->set(p, data))
+					res = 0;
+				p->lineData = data;
+			}
+			
+			if (i==1 && !settings->lines->set_txd(p, p->ledStat[1]))
+				res = 0;
+		}
+	}
+
+	p->ledsSet = 1;
+	return res;
+}
+
+
+static int handle_led_timer(int timer, uint64_t exp, void *data) {
+
+	Port *p = data;
+	int led = timer == p->ledTimer[0] ? 0 : 1;
+
+	if (exp & 1) {
+		p->ledStat[led] = 1 - p->ledStat[led];
+		/* the timer of LED 0 drives both if they are synced */
+		if (led == 0 && p->ledMode[0] == p->ledMode[1])
+			p->ledStat[1] = p->ledStat[0];
+	}
+	return set_leds(p);
+}
+
+
+static int stdin_to_serOut(int fd, uint32_t events, void *data) {
+
+	int bufSize = 100;
+	unsigned char buf [bufSize];
+	
+	int i;
+
+	int nbIn = read(0, buf, bufSize);	
+		
+	if (nbIn < 0)
+		return errno == EAGAIN || errno == EINTR;
+
+	if (nbIn == 0) {
+		/* EOF, LEDs keep their modes */
+		loop_del_fd(0);
+		return 1;
+	}
+	
+	if (settings->testmode) {
+		
+		int ignore = 0;
+		
+		if (nbIn >= 2 && nbIn <= 4 && buf[nbIn-1] == '\n') {
+			int tmp = 0;									
+			for (i = 0; i< nbIn-1; i++) {
+				if (buf[i] >= '0' && buf[i] <= '9')
+					tmp = 10 * tmp + (buf[i] - '0');
+				else 
+					ignore = 1;
+			}
+			if (tmp > 0xFF)
+				ignore = 1;
+			if (!ignore) {
+				buf[0] = tmp;
+				nbIn = 1;
+			}
+		} else {
+			ignore = 1;
+		}	
+		if (ignore)	{
+			info("ignored:");
+			for (i = 0; i< nbIn; i++) 
+				if (buf[i]>= 0x20 && buf[i]< 0x7F)
+					info("%d: 0x%02x '%c')", i, buf[i], buf[i]);
+				else
+					info("%d: 0x%02x)", i, buf[i]);
+			nbIn = 0;
+		}
+	}
+	
+	if (nbIn > 10) {
+		stat_add(settings->statBacklog, 1);
+		error("Found at least %d bytes in stdin. => May read slower than writer writes.",nbIn);
+	}
+	
+	return set_led_modes(buf, nbIn);
+}
+
+
+/* Takes the modes of one command of the LEDs of a port: 2 decimal 
+ * digits, the mode of LED 1 and LED 0. */
+static void take_led_command(Port *p, unsigned char cmd) {
+
+	int *serOutMode = p->ledMode;
+	int newMode[] = { cmd % 10, (cmd/10) % 10 };
+	int j;
+
+	for (j = 0; j < 2; j++) {
+		if (newMode[j] != 9) {
+			if (serOutMode[j] != newMode[j] && settings->testmode) {
+				if (settings->portNb > 1)
+					info("LED %d of port %d set to mode %d.",j,p->nr,newMode[j]);
+				else
+					info("LED %d set to mode %d.",j,newMode[j]);
+			}
+			serOutMode[j] = newMode[j];
+		}
+	}
+}
+
+
+/* Applies LED commands. With more than 1 port, LED_SELECT + <n> and
+ * LED_SELECT_ALL choose the ports of the following commands. */
+static int set_led_modes(const unsigned char *buf, int nb) {
+
+	int i,j;
+
+	stat_add(settings->statLedCmds, nb);
+	cap_write(CAP_LEDS, buf, nb);
+
+	for (i = 0; i < nb; i++) {
+		
+		if (settings->portNb > 1) {
+			if (buf[i] >= LED_SELECT && buf[i] < LED_SELECT + settings->portNb) {
+				settings->ledPort = buf[i] - LED_SELECT;
+				continue;
+			}
+			if (buf[i] == LED_SELECT_ALL) {
+				settings->ledPort = -1;
+				continue;
+			}
+		}
+
+		if (settings->ledPort >= 0)
+			take_led_command(&settings->port[settings->ledPort], buf[i]);
+		else
+			for (j = 0; j < settings->portNb; j++)
+				take_led_command(&settings->port[j], buf[i]);
+	} 
+
+	int res = 1;
+	for (j = 0; j < settings->portNb; j++) {
+
+		Port *p = &settings->port[j];
+		int *serOutMode = p->ledMode;
+		int *serOutStat = p->ledStat;
+
+		if (!schedule_blink(p))
+			return 0;
+
+		for (i = 0; i < 2; i++) {
+
+			p->ledModeOld[i] = serOutMode[i];
+
+			if (serOutMode[i] == 0) 
+				serOutStat[i] = 0;
+			
+			if (serOutMode[i] == 1) 
+				serOutStat[i] = 1;
+		}	
+		
+		if (!set_leds(p))
+			res = 0;
+	}
+	return res;
+}
+
+
+/* Records a sample of a port for -r. */
+static void record_sample(Port *p, int type, const void *buf, int nb) {
+
+	unsigned char rec[1 + sizeof(int)];
+
+	rec[0] = p->nr;
+	memcpy(rec + 1, buf, nb);
+	cap_write(type, rec, nb + 1);
+}
+
+
+/* Takes a sample of the button lines of a port and its taps. */
+static int take_sample(Port *p, unsigned char taps, const struct timespec *at) {
+
+	if (taps != 0) {
+		record_sample(p, CAP_TAPS, &taps, 1);
+		if (!report_taps(p, taps, at))
+			return 0;
+	}
+	record_sample(p, CAP_LINES, &p->lineData, sizeof(int));
+	return serIn_to_stdout(p, p->lineData, at);
+}
+
+
+/* Reads the button lines and keeps sampling every <delay> ms while a
+ * button is settling - or all the time without TIOCMIWAIT. */
+static int sample_buttons(Port *p) {
+
+	stat_add(settings->statSamples, 1);
+
+	p->taps = 0;
+	if (!settings->lines->get(p, &p->lineData))
+		return 0;
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (!take_sample(p, p->taps, &now))
+		return 0;
+
+	/* a tap is activity for the adaptive polling */
+	if (p->taps != 0)
+		p->inputBusy = 1;
+
+	if (p->settleLoops > 0)
+		p->settleLoops--;
+
+	if (!p->waitMode)
+		return set_sampling(p, poll_interval(p));
+
+	return set_sampling(p, p->inputBusy || p->settleLoops > 0 ? settings->delay : 0);
+}
+
+
+static int handle_edge(int fd, uint32_t events, void *data) {
+
+	Port *p = data;
+	uint64_t cnt;
+	if (read(p->waitFd, &cnt, sizeof(cnt)) != sizeof(cnt))
+		return 1;
+
+	int err = __atomic_load_n(&p->waitErr, __ATOMIC_ACQUIRE);
+	if (err) {
+		info("TIOCMIWAIT not usable on '%s' (%s). Polling every %d to %d ms.",
+				p->path, strerror(err), settings->delay, settings->idleMs);
+		p->waitMode = 0;
+	} else {
+		stat_add(settings->statEdges, 1);
+		p->settleLoops = settings->loopsIn;
+	}
+	return sample_buttons(p);
+}
+
+
+static int handle_sample_timer(int timer, uint64_t exp, void *data) {
+
+	Port *p = data;
+	if (!p->waitMode) {
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (p->pollWakeups++ == 0)
+			p->pollStart = now;
+		else
+			stat_record(settings->statPollInterval, (now.tv_sec - p->pollLast.tv_sec) * 1000000L
+											+ (now.tv_nsec - p->pollLast.tv_nsec) / 1000);
+		p->pollLast = now;
+	}
+	return sample_buttons(p);
+}
+
+
+/* The timing of the thread of -T: the sampling interval and the samples
+ * without a change after which it waits for the next edge, enough to
+ * take a pending change after the debounce time. */
+static void get_thread_timing(int *delay, int *quietNb) {
+
+	pthread_mutex_lock(&timingLock);
+	int ms = settings->pressMs > settings->releaseMs ? settings->pressMs : settings->releaseMs;
+	int nb = ms / settings->delay + 2;
+	*delay = settings->delay;
+	*quietNb = nb > 2 * settings->loopsIn ? nb : 2 * settings->loopsIn;
+	pthread_mutex_unlock(&timingLock);
+}
+
+
+/* Runs in its own thread with -T: samples the button lines every <delay>
+ * ms - after an edge until they are quiet or all the time without
+ * TIOCMIWAIT - and hands the samples to the loop through the ring. It
+ * never waits for the loop. It is cancelled only while waiting. */
+static void * sample_thread(void *arg) {
+
+	Port *p = arg;
+	int waitMode = p->waitMode;
+	int quiet = 0;
+	int last = -1;
+	int dropped = 0;
+	struct timespec next;
+	Icount icount = { .usable = 1 };
+
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &next);
+
+	while (1) {
+
+		int delay, quietNb;
+		get_thread_timing(&delay, &quietNb);
+
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+		if (waitMode && quiet >= quietNb) {
+			/* ioctl() is no cancellation point */
+			pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, NULL);
+			int res = ioctl(p->fd, TIOCMIWAIT, BUTTON_PINS);
+			int err = errno;
+			pthread_setcanceltype(PTHREAD_CANCEL_DEFERRED, NULL);
+			if (res == -1 && err != EINTR) {
+				__atomic_store_n(&p->waitErr, err, __ATOMIC_RELEASE);
+				waitMode = 0;
+			}
+			quiet = 0;
+			clock_gettime(CLOCK_MONOTONIC, &next);
+		} else {
+			next.tv_nsec += delay * 1000000L;
+			if (next.tv_nsec >= 1000000000L) {
+				next.tv_sec++;
+				next.tv_nsec -= 1000000000L;
+			}
+			clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+		}
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+		Sample s;
+		int prev = last;
+		int r = read_lines(p, &icount, &last, &s.taps);
+		s.data = r != 0 ? last : -1;
+		s.skipped = r == 2;
+		clock_gettime(CLOCK_MONOTONIC, &s.at);
+		s.dropped = dropped;
+
+		quiet = ((s.data ^ prev) & BUTTON_PINS) || s.taps ? 0 : quiet + 1;
+
+		if (ring_put(p->ring, &s))
+			dropped = 0;
+		else
+			dropped++;
+
+		if (s.data == -1)
+			return NULL;
+	}
+}
+
+
+static int start_sample_thread(Port *p) {
+
+	/* the thread must not take the signals from the main loop */
+	sigset_t all, old;
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+
+	int err = pthread_create(&p->thread, NULL, sample_thread, p);
+
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	if (err != 0) {
+		error("Can't start sampling thread: %s.", strerror(err));
+		return 0;
+	}
+	p->threadRunning = 1;
+	return 1;
+}
+
+
+/* Takes the samples of the thread of -T of a port. */
+static int handle_samples(int fd, uint32_t events, void *data) {
+
+	Port *p = data;
+	int err = __atomic_load_n(&p->waitErr, __ATOMIC_ACQUIRE);
+	if (err && p->waitMode) {
+		info("TIOCMIWAIT not usable on '%s' (%s). Polling every %d ms.",
+				p->path, strerror(err), settings->delay);
+		p->waitMode = 0;
+	}
+
+	Sample s;
+	while (ring_get(p->ring, &s)) {
+
+		if (s.data == -1) {
+			error("Can't read from serial port '%s' (TIOCMGET).",p->path);
+			return 0;
+		}
+
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		stat_record(settings->statHandoff, (now.tv_sec - s.at.tv_sec) * 1000000L 
+										+ (now.tv_nsec - s.at.tv_nsec) / 1000);
+		stat_add(settings->statRingFull, s.dropped);
+		stat_add(settings->statSamples, 1);
+
+		/* the LED lines of a skipped sample are those set since */
+		if (s.skipped)
+			stat_add(settings->statSkipped, 1);
+		else
+			p->lineData = s.data;
+
+		if (!take_sample(p, s.taps, &s.at))
+			return 0;
+	}
+	return 1;
+}
+
+
+/* Replay of -R: the recorded samples and LED commands take the place of
+ * the ports and stdin. Nothing is sampled, the LEDs only exist in the
+ * testmode messages. */
+static int replay_record(int type, const unsigned char *buf, int nb, const struct timespec *at, void *data) {
+
+	if (type == CAP_LEDS)
+		return set_led_modes(buf, nb);
+
+	if (type == CAP_PORTS && nb == 1) {
+		if (buf[0] < 1 || buf[0] > PORTS_MAX) {
+			error("Replay of %d ports isn't possible.", buf[0]);
+			return 0;
+		}
+		settings->portNb = buf[0];
+		return check_port_nb();
+	}
+
+	/* a capture of one port from before CAP_PORTS, without the port byte */
+	if ((type == CAP_LINES && nb == sizeof(int)) || (type == CAP_TAPS && nb == 1)) {
+		unsigned char rec[1 + sizeof(int)] = { 0 };
+		memcpy(rec + 1, buf, nb);
+		settings->portNb = 1;
+		return replay_record(type, rec, nb + 1, at, data);
+	}
+
+	if (nb < 1 || buf[0] >= settings->portNb)
+		return 1;
+
+	Port *p = &settings->port[buf[0]];
+
+	if (type == CAP_TAPS && nb == 2)
+		return report_taps(p, buf[1], at);
+
+	if (type == CAP_LINES && nb == 1 + sizeof(int)) {
+		stat_add(settings->statSamples, 1);
+		memcpy(&p->lineData, buf + 1, sizeof(int));
+		return serIn_to_stdout(p, p->lineData, at);
+	}
+	return 1;
+}
+
+
+/* The records of all ports come from one file. */
+static int replay_open(Port *p) {
+	return p->nr > 0 || cap_replay(settings->replayPath, settings->replaySpeed, replay_record, NULL);
+}
+
+
+static int replay_get(Port *p, int *data) {
+	*data = p->lineData;
+	return 1;
+}
+
+
+static int replay_set(Port *p, int data) {
+	return 1;
+}
+
+
+static int replay_watch(Port *p) {
+	return 1;
+}
+
+
+static Lines replayLines = { replay_open, replay_get, replay_set, replay_set, replay_watch };
+
+
+#ifndef CTRL_MULTI
+
+/* Takes the timing of reload_settings() and rearms the timers with it.
+ * Returns 0 if a timer failed. */
+static int set_timing(const int *blinkMs, int delay, int loopsIn, int idleMs, 
+						int pressMs, int releaseMs) {
+
+	pthread_mutex_lock(&timingLock);
+	memcpy(settings->blinkMs, blinkMs, 7 * sizeof(int));
+	settings->delay = delay;
+	settings->loopsIn = loopsIn;
+	settings->idleMs = idleMs;
+	settings->pressMs = pressMs;
+	settings->releaseMs = releaseMs;
+	pthread_mutex_unlock(&timingLock);
+
+	int i, j;
+	for (j = 0; j < settings->portNb; j++) {
+
+		Port *p = &settings->port[j];
+		int *mode = p->ledMode;
+		int sync = mode[0] == mode[1];
+		for (i = 0; i < 2; i++)
+			if (is_blink_mode(mode[i]) && !(sync && i == 1) && !start_blink_timer(p, i, mode[i], -1))
+				return 0;
+
+		/* polling starts over at the new <delay> */
+		if (p->sampling > 0) {
+			p->quietSamples = 0;
+			if (!loop_set_timer(p->sampleTimer, delay, delay))
+				return 0;
+			p->sampling = delay;
+		}
+	}
+	return 1;
+}
+
+
+/* Called on SIGHUP with the options of the config file: takes the new
+ * timing between two events. The port stays open, the LED modes and the
+ * debounce state are kept. If a timer fails the old timing is set again. */
+static int reload_settings() {
+
+	int blinkMs[7], delay, loopsIn, idleMs, pressMs, releaseMs;
+	if (!get_timing_opts(blinkMs, &delay, &loopsIn, &idleMs, &pressMs, &releaseMs))
+		return 0;
+
+	int oldBlinkMs[7];
+	memcpy(oldBlinkMs, settings->blinkMs, sizeof(oldBlinkMs));
+	int oldDelay = settings->delay, oldLoopsIn = settings->loopsIn, oldIdleMs = settings->idleMs;
+	int oldPressMs = settings->pressMs, oldReleaseMs = settings->releaseMs;
+
+	if (!set_timing(blinkMs, delay, loopsIn, idleMs, pressMs, releaseMs)) {
+		set_timing(oldBlinkMs, oldDelay, oldLoopsIn, oldIdleMs, oldPressMs, oldReleaseMs);
+		return 0;
+	}
+
+	if (settings->testmode)
+		info("Polling %d to %d ms, debounce %d ms press, %d ms release, blink modes %d %d %d %d %d %d %d ms.", 
+				delay, idleMs, pressMs, releaseMs, blinkMs[0], blinkMs[1], blinkMs[2], blinkMs[3], blinkMs[4], blinkMs[5], blinkMs[6]);
+	return 1;
+}
+
+#endif
+
+
+static int create_wait_fd(Port *p) {
+
+	if (!p->waitMode || settings->threaded)
+		return 1;
+
+	p->waitFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (p->waitFd < 0) {
+		int err = errno;
+		error("Can't create eventfd: %s.", strerror(err));
+		return 0;
+	}
+	return 1;
+}
+
+
+/* The timers and fds of a port, all of them called with the port. */
+static int init_port_events(Port *p) {
+
+	p->sampleTimer = loop_add_timer(handle_sample_timer, p);
+	p->ledTimer[0] = loop_add_timer(handle_led_timer, p);
+	p->ledTimer[1] = loop_add_timer(handle_led_timer, p);
+
+	if (	p->sampleTimer < 0 
+		||	p->ledTimer[0] < 0 || p->ledTimer[1] < 0
+		||	!create_wait_fd(p)
+		||	(p->waitFd >= 0 && !loop_add_fd(p->waitFd, EPOLLIN, handle_edge, p))) {
+
+		return 0;
+	}
+
+	if (settings->threaded) {
+		p->ring = ring_new(sizeof(Sample), RING_SIZE);
+		if (	p->ring == NULL
+			||	!loop_add_fd(ring_fd(p->ring), EPOLLIN, handle_samples, p)) {
+			
+			return 0;
+		}
+	}
+	return 1;
+}
+
+
+static int init_event_loop() {
+
+	if (!loop_init())
+		return 0;
+
+	int i;
+	for (i = 0; i < settings->portNb; i++)
+		if (!init_port_events(&settings->port[i]))
+			return 0;
+
+	/* stdin can't be watched if it is a regular file, e.g. /dev/null */
+	if (settings->replayPath == NULL && !loop_add_fd(0, EPOLLIN, stdin_to_serOut, NULL)) {
+		if (errno != EPERM)
+			return 0;
+		if (settings->testmode)
+			info("stdin can't be polled - LED commands are ignored.");
+	}
+	return 1;
+}
+
+
+static void print_test_header() {
+
+	int i;
+		
+	printf("\nTest mode - %s\n\n",RELEASE);
+
+	for (i = 0; i < 7; i++)
+		printf("blink mode %d: %d ms\n",i+2,settings->blinkMs[i]);
+
+	printf("\n");
+
+	for (i = 0; i < 2; i++)
+		printf("mode LED %d: %d\n",i,settings->port[0].ledMode[i]);
+	
+	if (settings->replayPath == NULL && settings->portNb > 1) {
+		printf("\n");
+		for (i = 0; i < settings->portNb; i++)
+			printf("port %d: %s\n",i,settings->port[i].path);
+	}
+
+	printf("\nButton lines are %s.\n", settings->waitMode ? "waited for (TIOCMIWAIT)" : "polled");
+	printf("\nPlease press a button connected to the serial port\n");
+	printf("or enter 1-3 digits followed by the Return key.\n\n");
+	fflush(stdout);
+}
+
+
+static int start_port(Port *p) {
+
+	if (settings->threaded)
+		return start_sample_thread(p) && set_leds(p);
+
+	if (settings->replayPath != NULL)
+		return set_leds(p);
+
+	return	(!p->waitMode || settings->lines->watch(p))
+		&&	sample_buttons(p) && set_leds(p);
+}
+
+
+static int start() {
+
+	if (!init_settings() || !init_event_loop())
+		return 0;
+
+	/* coalesce would keep the units of the last port only */
+	char *policy;
+	if (settings->tagByte && get_opt_str('o', 0, &policy) && strcmp(policy, "coalesce") == 0) {
+		error("Option '-G' can't be used with '-o coalesce'.");
+		return 0;
+	}
+
+	int i;
+	for (i = 0; i < settings->portNb; i++)
+		if (!settings->lines->open(&settings->port[i]))
+			return 0;
+
+	if (settings->testmode)
+		print_test_header();
+	else if (!init_output_opt('o', 'q', settings->tagByte ? OUT_DROP_OLDEST : OUT_COALESCE, 4096))
+		return 0;
+
+	for (i = 0; i < settings->portNb; i++)
+		if (!start_port(&settings->port[i]))
+			return 0;
+	return 1;
+}
+
+
+#ifdef CTRL_MULTI
+
+Backend serialBackend = { "serial", OPTIONS, 1, start, free_settings };
+
+#else
+
+int main(int argc, char *argv[]){
+	
+	if (!init_util(PROG, argc, argv, OPTIONS))
+		my_exit(EXIT_FAILURE);
+    
+    if (get_opt_str('h', 0, NULL)) {
+		print_info();
+		my_exit(EXIT_SUCCESS);
+	}
+
+	if (!init_config('c', reload_settings) || !start())
+		my_exit(EXIT_FAILURE);
+
+	my_exit(loop_run() ? EXIT_SUCCESS : EXIT_FAILURE);
+	
+	return EXIT_FAILURE;
+}
+
+#endif
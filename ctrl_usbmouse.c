@@ -23,31 +23,156 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 #include <libusb-1.0/libusb.h>
 #include <unistd.h>
 #include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <time.h>
 
 #include "util.h"
+#include "backend.h"
 
 #define PROG "ctrl_usbmouse"
 #define RELEASE PROG " 0.0.1"
 
-
-typedef struct Settings {
-	
+/* number of interrupt transfers kept in flight per mouse */
+#define TRANSFER_NB 2
+
+/* maximal number of mice handled by one process */
+#define MOUSE_MAX 8
+
+#define OPTIONS ":b:c:Fg:Ghi:o:q:r:R:tw:x:z"
+
+/* longest interrupt report: wMaxPacketSize of high speed devices */
+#define REPORT_MAX 1024
+
+/* longest HID report descriptor read */
+#define RDESC_MAX 2048
+
+/* records of -r, the number of the mouse first */
+#define CAP_MOUSE  1      /* the report size of an opened mouse, 2 bytes */
+#define CAP_REPORT 2      /* a raw interrupt report */
+#define CAP_RDESC  3      /* the HID report descriptor of an opened mouse */
+
+/* items of HID report descriptors, the prefix without the data size */
+#define HID_INPUT        0x80
+#define HID_USAGE_PAGE   0x04
+#define HID_LOGICAL_MIN  0x14
+#define HID_REPORT_SIZE  0x74
+#define HID_REPORT_ID    0x84
+#define HID_REPORT_COUNT 0x94
+#define HID_PUSH         0xA4
+#define HID_POP          0xB4
+#define HID_USAGE        0x08
+#define HID_USAGE_MIN    0x18
+#define HID_USAGE_MAX    0x28
+#define HID_LONG_ITEM    0xFE
+
+#define HID_PAGE_DESKTOP  0x01
+#define HID_PAGE_BUTTON   0x09
+#define HID_PAGE_CONSUMER 0x0C
+#define HID_USAGE_WHEEL   0x38
+#define HID_USAGE_AC_PAN  0x238  /* horizontal wheel */
+
+/* maximal number of fields of the plan of a mouse */
+#define OP_MAX 8
+
+#define OP_BUTTONS 0
+#define OP_WHEEL   1
+#define OP_PAN     2
+
+/* largest wheel delta of a frame of -F */
+#define FRAME_DELTA_MAX 127
+
+
+/* One field of the reports to extract, compiled from the report
+ * descriptor by compile_plan(). */
+typedef struct Op {
+	int type;                  /* OP_BUTTONS, OP_WHEEL or OP_PAN */
+	int reportId;
+	int bit;                   /* offset in the report, with the id byte */
+	int size;                  /* bits, for OP_BUTTONS 1 per button */
+	int shift;                 /* OP_BUTTONS: number of the first button - 1 */
+	int isSigned;
+	int need;                  /* bytes the report must have */
+} Op;
+
+typedef struct Plan {
+	int hasIds;                /* reports start with their id */
+	int hasWheel;
+	int hasPan;
+	int reportLen;             /* bytes of the longest input report */
+	int opNb;
+	Op op[OP_MAX];
+} Plan;
+
+
+typedef struct Mouse {
+
+	int nr;
 	char * id;
-	int testMode;
 	int buttonIdx;
 	int wheelIdx;
-	int wheelZero;
-	int stop;
+	int tag;
 
-	struct libusb_context *ctx;
 	libusb_device *device;
 	libusb_device_handle *handle;
+	int interface;
+	int claimed;               /* interface claimed, kernel driver detached */
 	int endpoint;
 	int byteNb;
+	int rdescLen;              /* from the HID descriptor, 0 if unknown */
+	Plan plan;                 /* opNb 0: byte indices of -b and -w */
+	unsigned char buttons;     /* of the last report with buttons */
+
+	struct libusb_transfer *transfer[TRANSFER_NB];
+	unsigned char *transferBuf;
+	int inFlight;
+	unsigned char valueOld;
+	int wheelSum;              /* -F: deltas not sent yet */
+	int panSum;
+	int framePending;          /* -F: waits for stdout to take the deltas */
+	int errorMsgLeft;
+
+	libusb_device *arrived;    /* set by hotplug_event() */
+	int left;                  /* set by hotplug_event() */
+	int replugged;
+	struct timespec arrivalTime;
+
+} Mouse;
+
+
+typedef struct Settings {
+	
+	char **ids;
+	int testMode;
+	int wheelZero;
+	int tagByte;               /* tag sent as extra byte, not OR'ed */
+	int byteIdx;               /* -b or -w given, the plan isn't used */
+	int frames;                /* -F */
+	char *replayPath;
+	int replaySpeed;
+	int stop;
+	int failed;
+
+	struct libusb_context *ctx;
+	int usbTimer;              /* libusb timeouts if its fds don't cover them */
+	int hotplug;               /* libusb reports (un)plugging */
+
+	int mouseNb;
+	Mouse mouse[MOUSE_MAX];
+
+	int statReports;
+	int statShort;             /* reports of the wrong length */
+	int statOther;             /* reports without a field of the plan */
+	int statUnchanged;         /* reports that didn't change the output */
+	int statCoalesced;         /* -F: reports summed up in a pending frame */
+	int statErrors;            /* failed transfers */
+	int statOut;
 
 } Settings;
 
@@ -55,30 +180,47 @@ typedef struct Settings {
 static Settings * settings = NULL;
 
 
-int my_exit(int retVal) {
-	
-	if (settings == NULL)
-		exit(retVal);
+static void close_device(Mouse *m);
 
-	if (settings->handle != NULL) {
 
-		if (libusb_release_interface(settings->handle,0) != 0)
-			error("Can't release mouse interface.");
+static void free_settings() {
+	
+	if (settings == NULL)
+		return;
 
-		if (libusb_kernel_driver_active(settings->handle,0) == 0 
-			&& libusb_attach_kernel_driver(settings->handle,0) != 0)
-			error("Can't attach kernel driver.");
+	/* transfers completing from now on are not resubmitted */
+	settings->stop = 1;
 
-		libusb_close(settings->handle);
+	int i;
+	for (i = 0; i < settings->mouseNb; i++) {
+		close_device(&settings->mouse[i]);
+		if (settings->mouse[i].arrived != NULL)
+			libusb_unref_device(settings->mouse[i].arrived);
 	}
 
 	if (settings->ctx != NULL) 
 		libusb_exit(settings->ctx);	
 
+	free(settings->ids);
+	free(settings);
+	settings = NULL;
+}
+
+
+#ifndef CTRL_MULTI
+
+static void my_exit(int retVal) {
+	
+	free_settings();
+	cap_close();
+	loop_free();
+	free_output();
 	info("Exit.");
 	exit(retVal);
 }
 
+#endif
+
 
 static int check_number(char *section, int number) {
 		
@@ -93,23 +235,58 @@ static int check_number(char *section, int number) {
 }
 
 
+/* The interrupt input of a HID interface, NULL if there is none. */
+static const struct libusb_endpoint_descriptor * get_hid_input(const struct libusb_interface_descriptor *interdesc) {
+
+	int i;
+
+	if (interdesc->bInterfaceClass != 3)
+		return NULL;
+
+	for (i = 0; i < interdesc->bNumEndpoints; i++) {
+		const struct libusb_endpoint_descriptor *epdesc = &interdesc->endpoint[i];
+		if (	(epdesc->bEndpointAddress & LIBUSB_ENDPOINT_IN)
+			&&	(epdesc->bmAttributes & LIBUSB_TRANSFER_TYPE_MASK) == LIBUSB_TRANSFER_TYPE_INTERRUPT) {
+
+			return epdesc;
+		}
+	}
+	return NULL;
+}
+
+
+/* Length of the report descriptor from the HID descriptor, 0 if unknown. */
+static int get_rdesc_len(const struct libusb_interface_descriptor *interdesc) {
+
+	const unsigned char *d = interdesc->extra;
+	int len = interdesc->extra_length;
+
+	while (len >= 2 && d[0] >= 2 && d[0] <= len) {
+		if (d[1] == LIBUSB_DT_HID && d[0] >= 9 && d[6] == LIBUSB_DT_REPORT)
+			return d[7] | d[8] << 8;
+		len -= d[0];
+		d += d[0];
+	}
+	return 0;
+}
+
+
 //returns ok 1, else 0 
-static int check_device(struct libusb_config_descriptor **configAddr) {
+static int check_device(Mouse *m, libusb_device *device, struct libusb_config_descriptor **configAddr) {
 
 	struct libusb_device_descriptor desc;
-	const struct libusb_interface *inter = NULL;
 	const struct libusb_interface_descriptor *interdesc = NULL;
 	const struct libusb_endpoint_descriptor *epdesc = NULL;
 	
 	char devId[10];
 
-	if (libusb_get_device_descriptor(settings->device, &desc) != 0) 
+	if (libusb_get_device_descriptor(device, &desc) != 0) 
 		return 0;
 	
 	snprintf(devId,10,"%04x:%04x",desc.idVendor,desc.idProduct);
 
 
-	if (strcasecmp(devId,settings->id) != 0) 
+	if (strcasecmp(devId,m->id) != 0) 
 		return 0;
 
 
@@ -117,52 +294,47 @@ static int check_device(struct libusb_config_descriptor **configAddr) {
 		return 0;
 	
 	
-	if (libusb_get_config_descriptor(settings->device, 0, configAddr) != 0){
+	if (libusb_get_config_descriptor(device, 0, configAddr) != 0){
 		error("Can't open config descriptor 0.");
 		*configAddr = NULL;
 		return 0;
 	}
 
-	if (check_number("interfaces",(*configAddr)->bNumInterfaces))
-		return 0;
-		
-	inter = &(*configAddr)->interface[0];
+	/* the first HID interface with an interrupt input, a boot mouse 
+	 * preferred, so combined mouse and keyboard receivers work as well */
+	int i;
+	for (i = 0; i < (*configAddr)->bNumInterfaces; i++) {
 
-	if (check_number("interface descriptors",inter->num_altsetting))
-		return 0;
-	
-	interdesc = &inter->altsetting[0];
+		const struct libusb_interface *inter = &(*configAddr)->interface[i];
+		if (inter->num_altsetting < 1)
+			continue;
 
-	/*check if it's a mouse */
-	if (interdesc->bInterfaceClass != 3 
-		|| interdesc->bInterfaceSubClass != 1
-		|| interdesc->bInterfaceProtocol !=2) {
+		const struct libusb_endpoint_descriptor *ep = get_hid_input(&inter->altsetting[0]);
+		if (ep == NULL || (epdesc != NULL && inter->altsetting[0].bInterfaceProtocol != 2))
+			continue;
 
-		error("Device doesn't seem to be a mouse.");
-		return 0;
+		interdesc = &inter->altsetting[0];
+		epdesc = ep;
+		if (interdesc->bInterfaceProtocol == 2)
+			break;
 	}
 
-	if (check_number("endpoints",interdesc->bNumEndpoints))
-		return 0;
-
-	epdesc = &interdesc->endpoint[0];
-	
-	int endpoint = (int)epdesc->bEndpointAddress;
-
-	if (endpoint < 0x80){
-		error("Endpoint address (%d) < 0x80 (==> not an input).",endpoint);
+	if (epdesc == NULL) {
+		error("Device doesn't seem to be a mouse (no HID interrupt input).");
 		return 0;
 	}
 
-	int byteNb = (int)epdesc->wMaxPacketSize;
+	int byteNb = (int)epdesc->wMaxPacketSize & 0x7FF;
 
-	if (byteNb < 1 || byteNb > 20){
-		error("Byte number (%d) not in [1..20].",byteNb);
+	if (byteNb < 1 || byteNb > REPORT_MAX){
+		error("Byte number (%d) not in [1..%d].",byteNb,REPORT_MAX);
 		return 0;
 	}
 
-	settings->endpoint = endpoint;
-	settings->byteNb = byteNb;
+	m->interface = interdesc->bInterfaceNumber;
+	m->endpoint = epdesc->bEndpointAddress;
+	m->byteNb = byteNb;
+	m->rdescLen = get_rdesc_len(interdesc);
 	
 	return 1;
 }
@@ -177,6 +349,23 @@ static int init_device() {
 	}
 		
 	libusb_set_debug(settings->ctx, LIBUSB_LOG_LEVEL_WARNING); 
+	return 1;
+}
+
+
+/* Devices with the same id as another mouse may already be taken. */
+static int is_taken(libusb_device *device) {
+
+	int i;
+	for (i = 0; i < settings->mouseNb; i++) 
+		if (settings->mouse[i].device == device || settings->mouse[i].arrived == device)
+			return 1;
+	return 0;
+}
+
+
+/* Enumerates the devices once, used if libusb has no hotplug support. */
+static int find_device(Mouse *m) {
 
 	libusb_device ** devLst = NULL;
 	ssize_t devNb = libusb_get_device_list(settings->ctx, &devLst);
@@ -184,106 +373,924 @@ static int init_device() {
 	int i;
 	for (i = 0; i< devNb; i++) {
 
-		settings->device = devLst[i];
+		if (is_taken(devLst[i]))
+			continue;
+
 		struct libusb_config_descriptor *config = NULL;
-		int ret = check_device(&config);
+		int ret = check_device(m, devLst[i], &config);
 		libusb_free_config_descriptor(config);
-		if (ret == 1) 
+		if (ret == 1) {
+			m->device = libusb_ref_device(devLst[i]);
 			break;
+		}
 	}
 
-	if (settings->endpoint < 0x80) {
-		error("No mouse with id %s found.",settings->id);
-		libusb_free_device_list(devLst,1);
+	libusb_free_device_list(devLst,1);
+
+	if (m->device == NULL) {
+		error("No mouse with id %s found.",m->id);
 		return 0;
 	}
+	return 1;
+}
+
+
+/* Value of the data of a short item, sign extended if isSigned. */
+static int item_value(const unsigned char *d, int size, int isSigned) {
+
+	switch (size) {
+		case 1: return isSigned ? (signed char)d[0] : d[0];
+		case 2: return isSigned ? (short)(d[0] | d[1] << 8) : (d[0] | d[1] << 8);
+		case 4: return (int)(d[0] | d[1] << 8 | d[2] << 16 | (unsigned)d[3] << 24);
+	}
+	return 0;
+}
+
+
+/* Adds a field of an input report to the plan, if it is a button or the
+ * wheel. Buttons next to each other are taken as one field. */
+static void add_op(Plan *plan, int usage, int reportId, int bit, int size, int isSigned) {
+
+	int page = usage >> 16;
+	int id = usage & 0xFFFF;
+	if (size < 1)
+		return;
+	Op *last = plan->opNb > 0 ? &plan->op[plan->opNb-1] : NULL;
+
+	int type;
+
+	if (page == HID_PAGE_BUTTON && id >= 1 && id <= 8 && size == 1) {
+		if (	last != NULL && last->type == OP_BUTTONS && last->reportId == reportId
+			&&	last->bit + last->size == bit && last->shift + last->size == id - 1) {
+
+			last->size++;
+			last->need = (bit + 8) / 8;
+			return;
+		}
+		type = OP_BUTTONS;
+	} else if (page == HID_PAGE_DESKTOP && id == HID_USAGE_WHEEL && !plan->hasWheel && size <= 24) {
+		type = OP_WHEEL;
+	} else if (page == HID_PAGE_CONSUMER && id == HID_USAGE_AC_PAN && !plan->hasPan && size <= 24) {
+		type = OP_PAN;
+	} else {
+		return;
+	}
+
+	if (plan->opNb == OP_MAX)
+		return;
+
+	Op *op = &plan->op[plan->opNb++];
+	op->type = type;
+	op->reportId = reportId;
+	op->bit = bit;
+	op->size = size;
+	op->shift = id - 1;
+	op->isSigned = type != OP_BUTTONS && isSigned;
+	op->need = (bit + size + 7) / 8;
+	if (type == OP_WHEEL)
+		plan->hasWheel = 1;
+	if (type == OP_PAN)
+		plan->hasPan = 1;
+}
+
+
+/* Compiles the HID report descriptor of a mouse into the fields to take
+ * from its input reports: the buttons 1-8 and the wheel, with their report
+ * id, bit offset, size and signedness. Returns 0 if it is malformed. */
+static int compile_plan(Plan *plan, const unsigned char *d, int len) {
+
+	/* the global items, with the stack of Push and Pop */
+	struct { int page, logMin, size, count, id; } g = { 0, 0, 0, 0, 0 }, stack[4];
+	int depth = 0;
+	int usages[16];
+	int usageNb = 0, usageMin = -1, usageMax = -1;
+	int bits[256];             /* of the input reports so far, per id */
+	int i;
+
+	memset(plan, 0, sizeof(Plan));
+	memset(bits, 0, sizeof(bits));
+
+	while (len > 0) {
+
+		int prefix = d[0];
+		if (prefix == HID_LONG_ITEM) {
+			if (len < 3 || len < 3 + d[1])
+				return 0;
+			len -= 3 + d[1];
+			d += 3 + d[1];
+			continue;
+		}
+
+		int size = (prefix & 3) == 3 ? 4 : prefix & 3;
+		if (len < 1 + size)
+			return 0;
+		int value = item_value(d + 1, size, 0);
+		int tag = prefix & 0xFC;
+
+		/* usages of 4 bytes carry their page */
+		int usage = size == 4 ? value : g.page << 16 | value;
+
+		switch (tag) {
+			case HID_USAGE_PAGE:   g.page = value; break;
+			case HID_LOGICAL_MIN:  g.logMin = item_value(d + 1, size, 1); break;
+			case HID_REPORT_SIZE:  g.size = value; break;
+			case HID_REPORT_COUNT: g.count = value; break;
+			case HID_REPORT_ID:
+				if (value < 1 || value > 255)
+					return 0;
+				g.id = value;
+				plan->hasIds = 1;
+				break;
+			case HID_PUSH:
+				if (depth == 4)
+					return 0;
+				stack[depth++] = g;
+				break;
+			case HID_POP:
+				if (depth == 0)
+					return 0;
+				g = stack[--depth];
+				break;
+			case HID_USAGE:
+				if (usageNb < 16)
+					usages[usageNb++] = usage;
+				break;
+			case HID_USAGE_MIN:    usageMin = usage; break;
+			case HID_USAGE_MAX:    usageMax = usage; break;
+		}
+
+		if (tag == HID_INPUT) {
+			/* checked before the offsets are taken, they come from the device */
+			if (	g.size < 0 || g.size > 32 || g.count < 0
+				||	(long long)g.count * g.size > 8 * REPORT_MAX - bits[g.id])
+				return 0;
+
+			/* data fields with a usage each, no arrays and constants */
+			int variable = (value & 3) == 2;
+			for (i = 0; i < g.count && variable; i++) {
+				int u = usageNb > 0 ? usages[i < usageNb ? i : usageNb - 1]
+						: usageMin < 0 ? -1 
+						: usageMin + i <= usageMax ? usageMin + i : usageMax;
+				if (u >= 0)
+					add_op(plan, u, g.id, bits[g.id] + i * g.size, g.size, g.logMin < 0);
+			}
+			bits[g.id] += g.count * g.size;
+		}
+
+		/* local items end with every main item */
+		if ((prefix & 0x0C) == 0) {
+			usageNb = 0;
+			usageMin = -1;
+			usageMax = -1;
+		}
+
+		len -= 1 + size;
+		d += 1 + size;
+	}
+
+	/* with ids the fields follow the id byte */
+	for (i = 0; plan->hasIds && i < plan->opNb; i++) {
+		plan->op[i].bit += 8;
+		plan->op[i].need += 1;
+	}
+	for (i = 0; i < 256; i++)
+		if ((bits[i] + 7) / 8 + plan->hasIds > plan->reportLen)
+			plan->reportLen = (bits[i] + 7) / 8 + plan->hasIds;
+	return 1;
+}
+
+
+/* Reads and compiles the report descriptor of an opened mouse. Without one
+ * the byte indices of -b and -w are used. */
+static void read_plan(Mouse *m) {
+
+	unsigned char rdesc[RDESC_MAX + 1];
+	int len = m->rdescLen > 0 && m->rdescLen < RDESC_MAX ? m->rdescLen : RDESC_MAX;
+
+	rdesc[0] = m->nr;
+	len = libusb_control_transfer(m->handle, 
+				LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_STANDARD | LIBUSB_RECIPIENT_INTERFACE,
+				LIBUSB_REQUEST_GET_DESCRIPTOR, LIBUSB_DT_REPORT << 8, m->interface, 
+				rdesc + 1, len, 1000);
+
+	if (len <= 0) {
+		info("Can't read the report descriptor of mouse %s - using bytes %d and %d.", 
+				m->id, m->buttonIdx, m->wheelIdx);
+		memset(&m->plan, 0, sizeof(Plan));
+		return;
+	}
+
+	cap_write(CAP_RDESC, rdesc, len + 1);
+
+	if (!compile_plan(&m->plan, rdesc + 1, len) || m->plan.opNb == 0) {
+		info("No buttons found in the report descriptor of mouse %s - using bytes %d and %d.", 
+				m->id, m->buttonIdx, m->wheelIdx);
+		memset(&m->plan, 0, sizeof(Plan));
+	}
+}
+
+
+static void trace_plan(Mouse *m) {
+
+	int i;
+	for (i = 0; i < m->plan.opNb; i++) {
+		Op *op = &m->plan.op[i];
+		if (op->type == OP_BUTTONS)
+			trace("report %d: buttons %d-%d at bit %d\n", op->reportId, 
+					op->shift + 1, op->shift + op->size, op->bit);
+		else
+			trace("report %d: %s at bit %d, %d bits%s\n", op->reportId, 
+					op->type == OP_WHEEL ? "wheel" : "horizontal wheel",
+					op->bit, op->size, op->isSigned ? " signed" : "");
+	}
+	if (m->plan.opNb > 0 && settings->byteIdx)
+		trace("bytes of -b and -w used instead\n");
+}
+
+
+static int uses_plan(Mouse *m) {
+	return m->plan.opNb > 0 && !settings->byteIdx;
+}
+
+
+/* Bytes of the longest report: from the report descriptor, else the
+ * packet size of the endpoint, reports may be shorter. */
+static int report_len(Mouse *m) {
+	return m->plan.reportLen > 0 ? m->plan.reportLen : m->byteNb;
+}
+
+
+/* The byte indices only matter if the plan isn't used. */
+static int check_indices(Mouse *m) {
+
+	if (uses_plan(m))
+		return 1;
+
+	int len = report_len(m);
+	if (m->buttonIdx < -1 || m->buttonIdx >= len) {
+		error("Value for '-b' option is not in [-1..%d] - found %d.", len - 1, m->buttonIdx);
+		return 0;
+	}
+	
+	if (m->wheelIdx < -1 || m->wheelIdx >= len) {
+		error("Value for '-w' option is not in [-1..%d] - found %d.", len - 1, m->wheelIdx);
+		return 0;
+	}
+	return 1;
+}
+
+
+static int start_transfers(Mouse *m);
+static void stop_transfers(Mouse *m);
+
+
+/* Opens and claims m->device and starts reading from it. */
+static int open_device(Mouse *m) {
 
 	libusb_set_debug(settings->ctx,  LIBUSB_LOG_LEVEL_NONE); 
 
-	if (libusb_open(settings->device, &settings->handle) != 0) {
+	if (libusb_open(m->device, &m->handle) != 0) {
 		int err = errno;
 		error("Can't open mouse device: %s.",strerror(err));
-		libusb_free_device_list(devLst,1);
+		m->handle = NULL;
 		return 0;
 	}
 
 	libusb_set_debug(settings->ctx, LIBUSB_LOG_LEVEL_WARNING); 
 
-	libusb_free_device_list(devLst,1);
-		
+	if (libusb_kernel_driver_active(m->handle,m->interface) == 1 
+		&& libusb_detach_kernel_driver(m->handle,m->interface) != 0){
+			
+		error("Can't detached kernel driver.");
+		return 0;
+	}
+	
+	if (libusb_claim_interface(m->handle,m->interface) != 0){
+		error("Can't claim interface.");
+		return 0;
+	}
+	m->claimed = 1;
+
+	read_plan(m);
+	if (!check_indices(m) || !start_transfers(m))
+		return 0;
+
+	unsigned char rec[3] = { m->nr, m->byteNb & 0xFF, m->byteNb >> 8 };
+	cap_write(CAP_MOUSE, rec, 3);
+
+	if (settings->testMode) {
+
+		trace("\n\nMouse %d (%s) found.\n",m->nr,m->id);
+		trace("interface: %d\n",m->interface);
+		trace("endpoint: 0x%02x\n",m->endpoint);
+		trace("byteNb: %d\n",m->byteNb);
+		trace_plan(m);
+	}
 	return 1;
 }
 
 
-void handle_input() {	
-	
-	unsigned char buf[settings->byteNb];
-	unsigned char valueOld = 0;
-	
-	int errorMsgLeft = 5;
-	
-	while (!stopped_by_signal()) {
-		
-		memset(buf, 0, settings->byteNb);
+static void close_device(Mouse *m) {
 
-		int transferred = 0;	
-		
-        if (libusb_interrupt_transfer(settings->handle, settings->endpoint, buf, 
-								settings->byteNb, &transferred , 100) != 0) {
+	stop_transfers(m);
+
+	if (m->handle != NULL) {
+
+		if (	m->claimed && libusb_release_interface(m->handle,m->interface) != 0 
+			&&	!m->left)
+			error("Can't release mouse interface.");
+
+		if (!m->left
+			&& libusb_kernel_driver_active(m->handle,m->interface) == 0 
+			&& libusb_attach_kernel_driver(m->handle,m->interface) != 0)
+			error("Can't attach kernel driver.");
+
+		libusb_close(m->handle);
+		m->handle = NULL;
+		m->claimed = 0;
+	}
+
+	if (m->device != NULL) {
+		libusb_unref_device(m->device);
+		m->device = NULL;
+	}
+	m->endpoint = -1;
+	m->wheelSum = 0;
+	m->panSum = 0;
+	m->framePending = 0;
+}
+
+
+static int handle_hotplug(void *data);
+
+
+/* Called from libusb_handle_events(). Only notes the event, the device is
+ * (re)opened by handle_hotplug() after the current round of the event
+ * loop. Identical mice share the callback of the first of them and take
+ * the next free slot. */
+static int LIBUSB_CALL hotplug_event(libusb_context *ctx, libusb_device *device, 
+								libusb_hotplug_event event, void *userData) {
+
+	Mouse *first = userData;
+	int i;
+
+	for (i = first->nr; i < settings->mouseNb; i++) {
 
+		Mouse *m = &settings->mouse[i];
+		if (strcasecmp(m->id, first->id) != 0)
 			continue;
-		}
 		
-		if (transferred != settings->byteNb) {
-			if (errorMsgLeft > 0) {
-				errorMsgLeft--;
-				error("Received %d bytes while expecting %d ==> ignored.",transferred, settings->byteNb);	
+		if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED) {
+			if (is_taken(device))
+				break;
+			if (m->device == NULL && m->arrived == NULL) {
+				m->arrived = libusb_ref_device(device);
+				clock_gettime(CLOCK_MONOTONIC, &m->arrivalTime);
+				loop_defer(handle_hotplug, m);
+				break;
+			}
+		} else if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT) {
+			if (device == m->device) {
+				m->left = 1;
+				loop_defer(handle_hotplug, m);
+				break;
 			}
+		}
+	}
+	return 0;
+}
+
+
+static double ms_since(struct timespec *t) {
+	
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - t->tv_sec) * 1000. + (now.tv_nsec - t->tv_nsec) / 1000000.;
+}
+
+
+static int handle_hotplug(void *data) {
+
+	Mouse *m = data;
+
+	if (m->left) {
+		info("Mouse %s unplugged - waiting for it.", m->id);
+		close_device(m);
+		m->left = 0;
+		m->replugged = 1;
+	}
+
+	if (m->arrived == NULL)
+		return 1;
+
+	libusb_device *device = m->arrived;
+	m->arrived = NULL;
+
+	struct libusb_config_descriptor *config = NULL;
+	int ret = check_device(m, device, &config);
+	libusb_free_config_descriptor(config);
+
+	if (!ret) {
+		libusb_unref_device(device);
+		return 1;
+	}
+
+	m->device = device;
+
+	/* e.g. usbhid still binding it: the next arrival may work */
+	if (!open_device(m)) {
+		close_device(m);
+		info("Mouse %s not usable - waiting for it to be plugged in again.", m->id);
+		return 1;
+	}
+
+	if (m->replugged)
+		info("Mouse %s replugged - ready after %.1f ms.", m->id, 
+				ms_since(&m->arrivalTime));
+	return 1;
+}
+
+
+/* Registers for the vendor:product of '-i'. libusb calls back for a
+ * device already plugged in before this returns. */
+static int init_hotplug() {
+
+	int i, j;
+	for (i = 0; i < settings->mouseNb; i++) {
+
+		Mouse *m = &settings->mouse[i];
+
+		/* one callback per id */
+		for (j = 0; j < i && strcasecmp(settings->mouse[j].id, m->id) != 0; j++);
+		if (j < i)
 			continue;
+
+		unsigned int vendor, product;
+		sscanf(m->id, "%4x:%4x", &vendor, &product);
+
+		libusb_hotplug_callback_handle handle;
+		if (libusb_hotplug_register_callback(settings->ctx, 
+					LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+					LIBUSB_HOTPLUG_ENUMERATE, vendor, product, LIBUSB_HOTPLUG_MATCH_ANY,
+					hotplug_event, m, &handle) != LIBUSB_SUCCESS) {
+
+			error("Can't register hotplug callback.");
+			return 0;
 		}
+	}
 
-		unsigned char value = 0;
-		
-		if (settings->buttonIdx >= 0) 
-			value = buf[settings->buttonIdx];
-			
-		if (settings->wheelIdx >= 0) {
+	for (i = 0; i < settings->mouseNb; i++) {
+		Mouse *m = &settings->mouse[i];
+		if (m->arrived == NULL)
+			info("No mouse with id %s found - waiting for it.",m->id);
+		if (!handle_hotplug(m))
+			return 0;
+	}
+	return 1;
+}
 
-			value &= 0x3f; /* clear bits 6 & 7 */
 
-			if (buf[settings->wheelIdx] > 0) {
-				value |= (buf[settings->wheelIdx] > 127) ? (1 << 6) : (1 << 7);
-				if (!settings->wheelZero)
-					valueOld = 0xFF; 
-			}
+static void send_value(Mouse *m, unsigned char value) {
+
+	int ok;
+	if (settings->tagByte) {
+		unsigned char buf[2] = { m->tag, value };
+		ok = out_write(buf, 2);
+	} else {
+		value |= m->tag;
+		ok = out_write(&value, 1);
+	}
+	stat_add(settings->statOut, 1);
+
+	if (!ok) {
+		error("Can't write to stdout.");
+		settings->failed = 1;
+		settings->stop = 1;
+	}
+}
+
+
+static void report_short(Mouse *m, int len, int need) {
+
+	stat_add(settings->statShort, 1);
+	if (m->errorMsgLeft > 0) {
+		m->errorMsgLeft--;
+		error("Received %d bytes while expecting at least %d ==> ignored.",len, need);	
+	}
+}
+
+
+/* Field of <size> bits at <bit> of buf, sign extended if isSigned. */
+static int get_bits(const unsigned char *buf, int bit, int size, int isSigned) {
+
+	uint64_t v = 0;
+	int i;
+
+	for (i = (bit + size - 1) >> 3; i >= bit >> 3; i--)
+		v = v << 8 | buf[i];
+	v = (v >> (bit & 7)) & ((1ULL << size) - 1);
+
+	if (isSigned && (v >> (size - 1)))
+		return (int)v - (1 << size);
+	return v;
+}
+
+
+/* Takes the buttons and the wheels of a report, with the plan of the mouse
+ * or the bytes of -b and -w. Returns 0 if the report has none of them. */
+static int get_input(Mouse *m, const unsigned char *buf, int len, int *wheel, int *pan) {
+
+	*wheel = 0;
+	*pan = 0;
+
+	if (!uses_plan(m)) {
+		/* reports may be shorter than the packet size */
+		int need = (m->buttonIdx > m->wheelIdx ? m->buttonIdx : m->wheelIdx) + 1;
+		if (len < need) {
+			report_short(m, len, need);
+			return 0;
 		}
-			
-		if (settings->testMode) {	
-			
-			int i;
-			for (i = 0; i < settings->byteNb; i++)  
-				printf("%4d ",(char)buf[i]);
-			
-			if (value != valueOld) {
-				char * str = get_multi_base_str(value);
-				printf("- send: %s",str);
-				free(str);
+		m->buttons = m->buttonIdx >= 0 ? buf[m->buttonIdx] : 0;
+		if (m->wheelIdx >= 0)
+			*wheel = (signed char)buf[m->wheelIdx];
+		return 1;
+	}
+
+	Plan *plan = &m->plan;
+	int found = 0;
+	int i;
+
+	for (i = 0; i < plan->opNb; i++) {
+
+		Op *op = &plan->op[i];
+		if (plan->hasIds && (len < 1 || buf[0] != op->reportId))
+			continue;
+		if (len < op->need) {
+			report_short(m, len, op->need);
+			return 0;
+		}
+
+		int v = get_bits(buf, op->bit, op->size, op->isSigned);
+		if (op->type == OP_BUTTONS) {
+			unsigned char mask = ((1 << op->size) - 1) << op->shift;
+			m->buttons = (m->buttons & ~mask) | (v << op->shift);
+		} else if (op->type == OP_WHEEL) {
+			*wheel = v;
+		} else {
+			*pan = v;
+		}
+		found = 1;
+	}
+
+	if (!found)
+		stat_add(settings->statOther, 1);
+	return found;
+}
+
+
+/* One trace line per report, with the byte to send if value isn't NULL. */
+static void trace_report(Mouse *m, const unsigned char *buf, int len, const unsigned char *value) {
+
+	char line[TRACE_LINE_LEN];
+	char str[MULTI_BASE_STR_LEN];
+	int lineLen = 0;
+	int i;
+	if (settings->mouseNb > 1)
+		lineLen += sprintf(line + lineLen, "%d: ", m->nr);
+	for (i = 0; i < len && lineLen < TRACE_LINE_LEN - 80; i++)  
+		lineLen += sprintf(line + lineLen, "%4d ", (char)buf[i]);
+	
+	if (value != NULL)
+		lineLen += sprintf(line + lineLen, "- send: %s", get_multi_base_str(*value, str));
+
+	trace("%s\n", line);
+}
+
+
+static int clamp_delta(int delta) {
+
+	if (delta > FRAME_DELTA_MAX)
+		return FRAME_DELTA_MAX;
+	if (delta < -FRAME_DELTA_MAX)
+		return -FRAME_DELTA_MAX;
+	return delta;
+}
+
+
+/* Sends the buttons and the summed up wheel deltas of a mouse as frames
+ * of -F, more than one if a delta doesn't fit in a byte. What stdout
+ * doesn't take at once waits for send_pending_frames(). */
+static void send_frames(Mouse *m) {
+
+	do {
+		int wheel = clamp_delta(m->wheelSum);
+		int pan = clamp_delta(m->panSum);
+		m->wheelSum -= wheel;
+		m->panSum -= pan;
+
+		unsigned char frame[4];
+		int nb = 0;
+		if (settings->tagByte)
+			frame[nb++] = m->tag;
+		frame[nb++] = settings->tagByte ? m->buttons : m->buttons | m->tag;
+		frame[nb++] = (signed char)wheel;
+		frame[nb++] = (signed char)pan;
+
+		if (settings->testMode) {
+			char str[MULTI_BASE_STR_LEN];
+			trace("  frame: buttons %s wheel %+d pan %+d\n", 
+					get_multi_base_str(m->buttons, str), wheel, pan);
+		} else {
+			stat_add(settings->statOut, 1);
+			if (!out_write(frame, nb)) {
+				error("Can't write to stdout.");
+				settings->failed = 1;
+				settings->stop = 1;
+				return;
 			}
+		}
+		m->valueOld = m->buttons;
+	} while ((m->wheelSum != 0 || m->panSum != 0) && !out_pending());
+
+	m->framePending = m->wheelSum != 0 || m->panSum != 0;
+}
+
+
+/* Called when stdout took everything: sends the deltas summed up while it
+ * was busy. */
+static int send_pending_frames(void *data) {
+
+	int i;
+	for (i = 0; i < settings->mouseNb && !out_pending(); i++)
+		if (settings->mouse[i].framePending)
+			send_frames(&settings->mouse[i]);
+	return !settings->failed;
+}
+
+
+/* -F: button changes are sent at once, wheel deltas only while stdout
+ * isn't busy. Until then they are summed up, so no tick gets lost and a
+ * burst of ticks takes one frame. */
+static void frame_report(Mouse *m, const unsigned char *buf, int len, int wheel, int pan) {
 
-			printf("\n");
-			fflush(stdout);
+	if (settings->testMode)
+		trace_report(m, buf, len, NULL);
+
+	if (m->buttons == m->valueOld && wheel == 0 && pan == 0) {
+		stat_add(settings->statUnchanged, 1);
+		return;
+	}
+
+	m->wheelSum += wheel;
+	m->panSum += pan;
+
+	if (m->buttons == m->valueOld && out_pending()) {
+		if (m->framePending)
+			stat_add(settings->statCoalesced, 1);
+		m->framePending = 1;
+		return;
+	}
+	send_frames(m);
+}
+
+
+/* Turns one interrupt report into the output byte. */
+static void handle_report(Mouse *m, const unsigned char *buf, int len) {
+
+	if (m->replugged) {
+		info("First report %.1f ms after the mouse was replugged.", 
+				ms_since(&m->arrivalTime));
+		m->replugged = 0;
+	}
+
+	stat_add(settings->statReports, 1);
+
+	int wheel, pan;
+	if (!get_input(m, buf, len, &wheel, &pan))
+		return;
+
+	if (settings->frames) {
+		frame_report(m, buf, len, wheel, pan);
+		return;
+	}
+
+	unsigned char valueOld = m->valueOld;
+	unsigned char value = m->buttons;
 		
-		} else {
-			if (value != valueOld) {
-				write(1,&value,1);
+	if (uses_plan(m) ? m->plan.hasWheel : m->wheelIdx >= 0) {
+
+		value &= 0x3f; /* clear bits 6 & 7 */
+
+		if (wheel != 0) {
+			value |= (wheel < 0) ? (1 << 6) : (1 << 7);
+			if (!settings->wheelZero)
+				valueOld = 0xFF; 
+		}
+	}
+		
+	if (settings->testMode) {	
+		trace_report(m, buf, len, value != valueOld ? &value : NULL);
+	} else {
+		if (value != valueOld) 
+			send_value(m, value);
+		else
+			stat_add(settings->statUnchanged, 1);
+	}
+	m->valueOld = value;	
+}
+
+
+static void record_report(Mouse *m, const unsigned char *buf, int len) {
+
+	unsigned char rec[CAP_DATA_MAX];
+
+	if (!cap_active() || len >= CAP_DATA_MAX)
+		return;
+
+	rec[0] = m->nr;
+	memcpy(rec + 1, buf, len);
+	cap_write(CAP_REPORT, rec, len + 1);
+}
+
+
+static void LIBUSB_CALL transfer_done(struct libusb_transfer *transfer) {
+
+	Mouse *m = transfer->user_data;
+
+	m->inFlight--;
+
+	switch (transfer->status) {
+
+		case LIBUSB_TRANSFER_COMPLETED:
+			record_report(m, transfer->buffer, transfer->actual_length);
+			handle_report(m, transfer->buffer, transfer->actual_length);
+			break;
+
+		case LIBUSB_TRANSFER_CANCELLED:
+			return;
+
+		case LIBUSB_TRANSFER_NO_DEVICE:
+			/* with hotplug support the mouse is reopened on replug */
+			if (!settings->hotplug) {
+				error("Mouse %s disconnected.", m->id);
+				settings->stop = 1;
+				settings->failed = 1;
 			}
+			return;
+
+		default:
+			stat_add(settings->statErrors, 1);
+			break;
+	}
+
+	if (settings->stop)
+		return;
+
+	if (libusb_submit_transfer(transfer) != 0) {
+		error("Can't resubmit transfer.");
+		settings->stop = 1;
+		settings->failed = 1;
+		return;
+	}
+	m->inFlight++;
+}
+
+
+/* Allocates the transfers and their buffers once and submits them. They
+ * are resubmitted from transfer_done(), so nothing is set up per report. */
+static int start_transfers(Mouse *m) {
+
+	m->transferBuf = malloc(TRANSFER_NB * m->byteNb);
+	if (m->transferBuf == NULL) {
+		noMem();
+		return 0;
+	}
+
+	int i;
+	for (i = 0; i < TRANSFER_NB; i++) {
+
+		struct libusb_transfer *transfer = libusb_alloc_transfer(0);
+		if (transfer == NULL) {
+			noMem();
+			return 0;
+		}
+		m->transfer[i] = transfer;
+
+		libusb_fill_interrupt_transfer(transfer, m->handle, m->endpoint,
+					m->transferBuf + i * m->byteNb, m->byteNb,
+					transfer_done, m, 0);
+
+		if (libusb_submit_transfer(transfer) != 0) {
+			error("Can't submit transfer.");
+			return 0;
 		}
-		valueOld = value;	
+		m->inFlight++;
 	}
-	
+	return 1;
 }
 
 
+static void stop_transfers(Mouse *m) {
+
+	int i;
+	for (i = 0; i < TRANSFER_NB; i++)
+		if (m->transfer[i] != NULL)
+			libusb_cancel_transfer(m->transfer[i]);
+
+	/* the cancellations are reported through transfer_done() */
+	int tries = 10;
+	while (m->inFlight > 0 && tries-- > 0) {
+		struct timeval tv = {0, 100000};
+		libusb_handle_events_timeout(settings->ctx, &tv);
+	}
+
+	for (i = 0; i < TRANSFER_NB; i++) {
+		if (m->transfer[i] != NULL && m->inFlight == 0)
+			libusb_free_transfer(m->transfer[i]);
+		m->transfer[i] = NULL;
+	}
+	m->inFlight = 0;
+
+	free(m->transferBuf);
+	m->transferBuf = NULL;
+}
+
+
+/* Without timerfd support libusb's timeouts need a timer of their own. */
+static int set_usb_timer() {
+
+	struct timeval tv;
+	if (settings->usbTimer < 0 || libusb_get_next_timeout(settings->ctx, &tv) != 1)
+		return 1;
+
+	int ms = tv.tv_sec * 1000 + (tv.tv_usec + 999) / 1000;
+	return loop_set_timer(settings->usbTimer, ms > 0 ? ms : 1, 0);
+}
+
+
+static int handle_usb() {
+
+	struct timeval zero = {0, 0};
+
+	if (libusb_handle_events_timeout(settings->ctx, &zero) != 0) {
+		error("Can't handle USB events.");
+		return 0;
+	}
+	if (settings->stop)
+		loop_stop();
+	return !settings->failed && set_usb_timer();
+}
+
+
+static int handle_usb_fd(int fd, uint32_t events, void *data) {
+	return handle_usb();
+}
+
+
+static int handle_usb_timer(int timer, uint64_t exp, void *data) {
+	return handle_usb();
+}
+
+
+static void LIBUSB_CALL usb_fd_added(int fd, short events, void *userData) {
+	loop_add_fd(fd, (events & POLLIN ? EPOLLIN : 0) | (events & POLLOUT ? EPOLLOUT : 0), 
+				handle_usb_fd, NULL);
+}
+
+
+static void LIBUSB_CALL usb_fd_removed(int fd, void *userData) {
+	loop_del_fd(fd);
+}
+
+
+static int init_event_loop() {
+
+	if (!loop_init())
+		return 0;
+
+	const struct libusb_pollfd **pollfds = libusb_get_pollfds(settings->ctx);
+	if (pollfds == NULL) {
+		error("Can't get USB file descriptors.");
+		return 0;
+	}
+	int i;
+	for (i = 0; pollfds[i] != NULL; i++)
+		usb_fd_added(pollfds[i]->fd, pollfds[i]->events, NULL);
+	libusb_free_pollfds(pollfds);
+
+	libusb_set_pollfd_notifiers(settings->ctx, usb_fd_added, usb_fd_removed, NULL);
+
+	if (!libusb_pollfds_handle_timeouts(settings->ctx)) {
+		settings->usbTimer = loop_add_timer(handle_usb_timer, NULL);
+		if (settings->usbTimer < 0)
+			return 0;
+	}
+	return 1;
+}
+
+
+#ifndef CTRL_MULTI
+
 static void print_info() {
 	printf("\n%s\n", RELEASE);
     printf("\n");
@@ -292,9 +1299,16 @@ static void print_info() {
     printf("It detaches an USB mouse from the kernel and listen to its actions.\n"); 
     printf("Changes of button states or wheel movement will lead to a byte\n");
     printf("written to stdout. (If not in testmode.)\n");
-    printf("(bits 0-5: button states (bits 0-7 if '-w -1'), bit 6: wheel down,\n");
+    printf("(bits 0-5: button states (bits 0-7 without wheel), bit 6: wheel down,\n");
     printf("bit 7: wheel up)\n");
     printf("\n");
+    printf("The buttons and the wheel are found in the HID report descriptor of\n");
+    printf("the mouse, testmode shows where. Without a usable descriptor, or if\n");
+    printf("-b or -w is given, whole bytes of the reports are taken instead.\n");
+    printf("\n");
+    printf("If libusb supports hotplug, the mouse may be unplugged and plugged\n");
+    printf("in again while the program is running.\n");
+    printf("\n");
     printf("Please visit the wiki for further information.\n");
     printf("\n");
     printf("usage:\n");
@@ -305,20 +1319,80 @@ static void print_info() {
     printf("  -h              help (this info)\n");
     printf("  -i <device id>  id of the USB mouse in the format of lsusb\n");
     printf("                  NOT optional\n");
+    printf("                  Up to %d mice may be given comma separated, e.g.\n", MOUSE_MAX);
+    printf("                  '-i 046d:c077,046d:c077,1bcf:0005'. Options -b, -w\n");
+    printf("                  and -g then take 1 value for all or 1 per mouse.\n");
+    printf("  -r <file>       record the raw reports of the mice to <file>\n");
+    printf("  -R <file>       replay a file of -r instead of reading the mice.\n");
+    printf("                  The ids of '-i' give the number of mice.\n");
+    printf("  -x <speed>      speed factor of -R, 0: as fast as possible. Default: 1\n");
     printf("  -t              testmode all raw bytes read from the mouse and\n");
     printf("                  the resulting byte in bin hex and dec.\n");
     printf("  -b <index>      index of the byte which will be interpreted\n");
-    printf("                  as button state - default: 0\n");
+    printf("                  as button state, -1: none - default: 0\n");
     printf("  -w <index>      index of the byte which will be interpreted\n");
-    printf("                  as wheel action - default: 3\n");
+    printf("                  as wheel action, -1: none - default: 3\n");
+    printf("  -g <tag>        tag [0..255] OR'ed to every byte of the mouse, use\n");
+    printf("                  bits the mouse never sets - default: 0\n");
+    printf("  -G              send the tag as an extra byte before every byte\n");
+    printf("                  instead. The default tag is then the mouse number.\n");
     printf("  -z              Wheel bits have to be changed for new output byte\n");
     printf("                  Set this option if -w is set to a rawbyte that\n"); 
     printf("                  indicates horizontal wheel movement.\n");
+    printf("  -F              send frames of 3 bytes instead: buttons (with the tag),\n");
+    printf("                  wheel and horizontal wheel as signed sums of the\n");
+    printf("                  ticks since the last frame. While stdout is busy\n");
+    printf("                  the ticks are summed up, button changes are sent at\n");
+    printf("                  once. -z is not used, '-o coalesce' not allowed.\n");
+    printf("  -c <file>       config file with further options, read again on SIGHUP.\n");
+    printf("                  -b, -w, -g and -z change while running.\n");
+    printf("  -o <policy>     what to do if stdout is not read fast enough and the\n");
+    printf("                  queue is full: 'oldest' or 'newest' (drop events),\n");
+    printf("                  'coalesce' (keep the latest state) or 'block'.\n");
+    printf("                  Default: oldest\n");
+    printf("  -q <bytes>      size of the stdout queue. Default: 4096\n");
     printf("\n");
+    printf("SIGUSR1 logs runtime statistics.\n");
+    printf("\n");
+}
+
+
+#endif
+
+
+/* Replay of -R: the recorded reports take the place of libusb. */
+static int replay_report(int type, const unsigned char *buf, int nb, const struct timespec *at, void *data) {
+
+	if (nb < 1 || buf[0] >= settings->mouseNb)
+		return 1;
+
+	Mouse *m = &settings->mouse[buf[0]];
+
+	if (type == CAP_RDESC) {
+		if (!compile_plan(&m->plan, buf + 1, nb - 1) || m->plan.opNb == 0)
+			memset(&m->plan, 0, sizeof(Plan));
+		return 1;
+	}
+
+	/* 1 byte of the report size in older files */
+	if (type == CAP_MOUSE && (nb == 2 || nb == 3)) {
+		m->byteNb = nb == 3 ? buf[1] | buf[2] << 8 : buf[1];
+		if (settings->testMode) {
+			trace("\n\nMouse %d (%s) found.\nbyteNb: %d\n", m->nr, m->id, m->byteNb);
+			trace_plan(m);
+		}
+		return check_indices(m);
+	}
+
+	if (type == CAP_REPORT && m->byteNb > 0) {
+		handle_report(m, buf + 1, nb - 1);
+		return !settings->failed;
+	}
+	return 1;
 }
 
 
-int is_id_format(char *idStr) {
+static int is_id_format(char *idStr) {
 	
 	int ok = 1;
 	int len = strlen(idStr);
@@ -346,7 +1420,7 @@ static int init_settings() {
 	
 	if (get_args(NULL) != 0) {
 		error("Non-option arguments given but not allowed.");
-		my_exit(EXIT_FAILURE);
+		return 0;
 	}
 	
 	settings = malloc(sizeof(Settings));
@@ -355,73 +1429,205 @@ static int init_settings() {
 		return 0;
 	}
 
+	settings->ids = NULL;
 	settings->ctx = NULL;
-	settings->device = NULL;
-	settings->handle = NULL;
-	settings->endpoint = -1;
-	settings->byteNb = -1;
-	settings->buttonIdx = 0;
-	settings->wheelIdx = 3;
 	settings->wheelZero = 0;
+	settings->tagByte = 0;
+	settings->byteIdx = get_opt_str('b', 0, NULL) || get_opt_str('w', 0, NULL);
+	settings->frames = get_opt_str('F', 0, NULL);
+	settings->replayPath = NULL;
+	settings->replaySpeed = 1;
 	settings->testMode = 0;
 	settings->stop = 0;
-
-	if (!get_opt_str('i', 0, &settings->id) || !is_id_format(settings->id)) {
+	settings->failed = 0;
+	settings->usbTimer = -1;
+	settings->hotplug = 0;
+	settings->mouseNb = 0;
+	settings->statReports = stat_counter("usbmouse reports");
+	settings->statShort = stat_counter("usbmouse wrong length");
+	settings->statOther = stat_counter("usbmouse other reports");
+	settings->statUnchanged = stat_counter("usbmouse unchanged");
+	settings->statCoalesced = stat_counter("usbmouse wheel deltas coalesced");
+	settings->statErrors = stat_counter("usbmouse transfer errors");
+	settings->statOut = stat_counter("usbmouse out");
+
+	char *idStr;
+	if (!get_opt_str('i', 0, &idStr)) {
 		error("No valide device id (option '-i') given.");
 		return 0;
 	}
+
+	int nb = split_str(idStr, ',', &settings->ids);
+	if (nb < 1 || nb > MOUSE_MAX) {
+		error("Option '-i' needs 1 to %d device ids.", MOUSE_MAX);
+		return 0;
+	}
+
+	int i, j;
+	for (i = 0; i < nb; i++) {
+		if (!is_id_format(settings->ids[i])) {
+			error("No valide device id (option '-i') given.");
+			return 0;
+		}
+	}
 		
+	/* coalesce drops the whole queue, with the button changes of -F */
+	char *policy;
+	if (settings->frames && get_opt_str('o', 0, &policy) && strcmp(policy, "coalesce") == 0) {
+		error("Option '-F' can't be used with '-o coalesce'.");
+		return 0;
+	}
+
 	if (get_opt_str('t', 0, NULL))
 		settings->testMode = 1;
+	else if (!init_output_opt('o', 'q', OUT_DROP_OLDEST, 4096))
+		return 0;
+	else if (settings->frames)
+		out_on_idle(send_pending_frames, NULL);
+
+	if (get_opt_str('G', 0, NULL))
+		settings->tagByte = 1;
 
+	int buttonIdx[MOUSE_MAX];
+	int wheelIdx[MOUSE_MAX];
+	int tag[MOUSE_MAX];
 
-	if (	!get_opt_int_default('b', 1, 0, &settings->buttonIdx)
-		||	!get_opt_int_default('w', 1, 3, &settings->wheelIdx)){
+	if (	!get_opt_int_list('b', 1, -1, 255, 0, nb, buttonIdx)
+		||	!get_opt_int_list('w', 1, -1, 255, 3, nb, wheelIdx)
+		||	!get_opt_int_list('g', 1, 0, 255, 0, nb, tag)){
 	
 		return 0;
 	}
 
-	if (settings->buttonIdx == settings->wheelIdx) {
-		error("Options '-b' and '-w' must be set to different values.");
-		my_exit(EXIT_FAILURE);
+	for (i = 0; i < nb; i++) {
+
+		Mouse *m = &settings->mouse[i];
+
+		m->nr = i;
+		m->id = settings->ids[i];
+		m->buttonIdx = buttonIdx[i];
+		m->wheelIdx = wheelIdx[i];
+		m->tag = (settings->tagByte && !get_opt_str('g', 0, NULL)) ? i : tag[i];
+		m->device = NULL;
+		m->handle = NULL;
+		m->interface = 0;
+		m->claimed = 0;
+		m->endpoint = -1;
+		m->byteNb = -1;
+		m->rdescLen = 0;
+		memset(&m->plan, 0, sizeof(Plan));
+		m->buttons = 0;
+		m->transferBuf = NULL;
+		m->inFlight = 0;
+		m->valueOld = 0;
+		m->wheelSum = 0;
+		m->panSum = 0;
+		m->framePending = 0;
+		m->errorMsgLeft = 5;
+		m->arrived = NULL;
+		m->left = 0;
+		m->replugged = 0;
+		for (j = 0; j < TRANSFER_NB; j++)
+			m->transfer[j] = NULL;
+
+		settings->mouseNb++;
+
+		if (m->buttonIdx == m->wheelIdx) {
+			error("Options '-b' and '-w' must be set to different values.");
+			return 0;
+		}
 	}
 	
 	if (get_opt_str('z', 0, NULL))
 		settings->wheelZero = 1;
+
+	char *capPath;
+	if (get_opt_str('r', 0, &capPath) && !cap_open(capPath))
+		return 0;
+
+	if (get_opt_str('R', 0, &settings->replayPath))
+		return	get_opt_int_between('x', 1, 0, 1000, 1, &settings->replaySpeed)
+			&&	loop_init()
+			&&	cap_replay(settings->replayPath, settings->replaySpeed, replay_report, NULL);
 		
-	if (!init_device())
+	if (!init_device() || !init_event_loop())
 		return 0;
 
+	settings->hotplug = libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG);
 
-	if (settings->buttonIdx < -1 || settings->buttonIdx >= settings->byteNb) {
-		error("Value for '-b' option is not in [-1..%d] - found %d.", settings->byteNb, settings->buttonIdx);
-		return 0;
-	}
-	
-	if (settings->wheelIdx < -1 || settings->wheelIdx >= settings->byteNb) {
-		error("Value for '-w' option is not in [-1..%d] - found %d.", settings->byteNb,settings->wheelIdx);
-		return 0;
+	if (settings->hotplug)
+		return init_hotplug();
+
+	for (i = 0; i < settings->mouseNb; i++) {
+		Mouse *m = &settings->mouse[i];
+		if (!find_device(m) || !open_device(m))
+			return 0;
 	}
+	return 1;
+}
+
+
+static int start() {
+	return init_settings() && set_usb_timer();
+}
+
+
+#ifdef CTRL_MULTI
+
+Backend usbmouseBackend = { "usbmouse", OPTIONS, 1, start, free_settings };
+
+#else
+
+/* Called on SIGHUP with the options of the config file: takes the new byte
+ * indices, tags and '-z' between two reports. The mice stay open, their
+ * plans are kept. */
+static int reload_settings() {
+
+	int buttonIdx[MOUSE_MAX];
+	int wheelIdx[MOUSE_MAX];
+	int tag[MOUSE_MAX];
+	int nb = settings->mouseNb;
+	int byteIdx = get_opt_str('b', 0, NULL) || get_opt_str('w', 0, NULL);
+
+	if (	!get_opt_int_list('b', 1, -1, 255, 0, nb, buttonIdx)
+		||	!get_opt_int_list('w', 1, -1, 255, 3, nb, wheelIdx)
+		||	!get_opt_int_list('g', 1, 0, 255, 0, nb, tag)){
 	
-	if (libusb_kernel_driver_active(settings->handle,0) == 1 
-		&& libusb_detach_kernel_driver(settings->handle,0) != 0){
-			
-		error("Can't detached kernel driver.");
 		return 0;
 	}
-	
-	if (libusb_claim_interface(settings->handle,0) != 0){
-		error("Can't claim interface.");
-		return 0;
+
+	int i;
+	for (i = 0; i < nb; i++) {
+		Mouse *m = &settings->mouse[i];
+		if (buttonIdx[i] == wheelIdx[i]) {
+			error("Options '-b' and '-w' must be set to different values.");
+			return 0;
+		}
+		/* mice not open yet are checked when they arrive */
+		if (	m->byteNb > 0 && (byteIdx || m->plan.opNb == 0)
+			&&	(buttonIdx[i] >= report_len(m) || wheelIdx[i] >= report_len(m))) {
+			error("Values for '-b' and '-w' of mouse %s have to be below %d.", m->id, report_len(m));
+			return 0;
+		}
 	}
 
+	for (i = 0; i < nb; i++) {
+		Mouse *m = &settings->mouse[i];
+		m->buttonIdx = buttonIdx[i];
+		m->wheelIdx = wheelIdx[i];
+		m->tag = (settings->tagByte && !get_opt_str('g', 0, NULL)) ? i : tag[i];
+	}
+	settings->wheelZero = get_opt_str('z', 0, NULL);
+	settings->byteIdx = byteIdx;
 	return 1;
 }
 
 
+/* Sleeps in the event loop until libusb has a completed report, a timeout
+ * to handle or a signal arrives. */
 int main(int argc, char *argv[]) {
 	
-	if (!init_util(PROG, argc, argv, ":b:hi:tw:z"))
+	if (!init_util(PROG, argc, argv, OPTIONS))
 		my_exit(EXIT_FAILURE);
 		
 	if (get_opt_str('h', 0, NULL)) {
@@ -429,19 +1635,14 @@ int main(int argc, char *argv[]) {
 		my_exit(EXIT_SUCCESS);
 	}
 
-	if (!init_settings()) 
+	if (!init_config('c', reload_settings) || !start()) 
 		my_exit(EXIT_FAILURE);
-
-	if (settings->testMode) {
-
-		printf("\n\nMouse found.\n");
-		printf("endpoint: 0x%02x\n",settings->endpoint);
-		printf("byteNb: %d\n",settings->byteNb);
-	}
 	
-	handle_input();
+	if (!loop_run() || settings->failed)
+		my_exit(EXIT_FAILURE);
 
 	my_exit(0);
 	return 0;
 }
-	
+
+#endif
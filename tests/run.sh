@@ -0,0 +1,89 @@
+#!/bin/sh
+# Builds the controllers and checks them against fixed inputs: the unit
+# checks of test_units.c, then the scripts of -S and the captures of -R,
+# whose stdout has to match the files in expected/ byte for byte.
+#
+# Usage: tests/run.sh [-u]
+#   -u  writes the current outputs to expected/ instead of comparing
+#
+# CC and CFLAGS may be set, LIBUSB to the flags to compile and link
+# against libusb-1.0 if pkg-config doesn't know them.
+
+cd "$(dirname "$0")" || exit 1
+
+CC=${CC:-cc}
+CFLAGS=${CFLAGS:--O2 -Wall}
+LIBUSB=${LIBUSB:-$(pkg-config --cflags --libs libusb-1.0)}
+UPDATE=0
+[ "$1" = "-u" ] && UPDATE=1
+
+BUILD=$(mktemp -d) || exit 1
+trap 'rm -rf "$BUILD"' EXIT
+
+$CC $CFLAGS -o "$BUILD/ctrl_serial" ../ctrl_serial.c ../util.c -lm -lpthread &&
+$CC $CFLAGS -o "$BUILD/ctrl_usbmouse" ../ctrl_usbmouse.c ../util.c $LIBUSB -lm -lpthread &&
+$CC $CFLAGS -Wno-unused-function -o "$BUILD/test_units" test_units.c ../util.c $LIBUSB -lm -lpthread ||
+	exit 1
+
+FAILED=0
+
+echo "unit checks"
+"$BUILD/test_units" 2>"$BUILD/test_units.err" || {
+	grep "check failed" "$BUILD/test_units.err"
+	FAILED=$((FAILED + 1))
+}
+
+# check <name> <controller> <options...>: compares stdout with expected/<name>
+check() {
+	name=$1
+	prog=$2
+	shift 2
+	echo "$name"
+	timeout 30 "$BUILD/$prog" "$@" >"$BUILD/$name" 2>"$BUILD/$name.err"
+	if [ $UPDATE = 1 ]; then
+		cp "$BUILD/$name" "expected/$name"
+	elif ! cmp -s "$BUILD/$name" "expected/$name"; then
+		echo "  stdout differs from expected/$name:"
+		od -An -tx1 -v "expected/$name" >"$BUILD/$name.want"
+		od -An -tx1 -v "$BUILD/$name" >"$BUILD/$name.got"
+		diff "$BUILD/$name.want" "$BUILD/$name.got" | sed 's/^/  /'
+		sed 's/^/  /' "$BUILD/$name.err"
+		FAILED=$((FAILED + 1))
+	fi
+}
+
+# -S runs in real time, the scripts leave enough room for the default
+# timing. Edges wake up the loop at once unless -P is given.
+check serial_press       ctrl_serial -S serial/press.sim
+check serial_press_poll  ctrl_serial -S serial/press.sim -P
+check serial_press_tags  ctrl_serial -S serial/press.sim -G
+check serial_bounce      ctrl_serial -S serial/bounce.sim
+check serial_bounce_e40  ctrl_serial -S serial/bounce.sim -e 40 -E 40
+
+# a capture taken with -r while simulating replays the same stdout
+check serial_record      ctrl_serial -S serial/press.sim -r "$BUILD/press.cap"
+check serial_replay      ctrl_serial -R "$BUILD/press.cap" -x 0
+[ $UPDATE = 1 ] || cmp -s "$BUILD/serial_record" "$BUILD/serial_replay" || {
+	echo "  serial_replay differs from serial_record"
+	FAILED=$((FAILED + 1))
+}
+
+# taps.cap: a tap of CTS counted by TIOCGICOUNT only, a press of CTS, then
+# a short release of CTS and a tap of CD. old.cap has the first record
+# layout, without taps.
+check serial_taps        ctrl_serial -R serial/taps.cap -x 0
+check serial_taps_tags   ctrl_serial -R serial/taps.cap -x 0 -G
+check serial_old         ctrl_serial -R serial/old.cap -x 0
+
+# wheel.cap: a mouse with report id 2, 5 buttons, wheel and AC pan of 8
+# bits, with a report too short for the pan and one of another id
+check usbmouse_report    ctrl_usbmouse -i 046d:c077 -R usbmouse/wheel.cap -x 0
+check usbmouse_frames    ctrl_usbmouse -i 046d:c077 -R usbmouse/wheel.cap -x 0 -F
+check usbmouse_trace     ctrl_usbmouse -i 046d:c077 -R usbmouse/wheel.cap -x 0 -t
+check usbmouse_bytes     ctrl_usbmouse -i 046d:c077 -R usbmouse/wheel.cap -x 0 -b 1 -w 4
+
+if [ $FAILED -gt 0 ]; then
+	echo "$FAILED checks failed."
+	exit 1
+fi
+echo "All checks passed."
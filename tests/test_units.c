@@ -0,0 +1,392 @@
+/* Unit checks of util.c and of the report parsing of ctrl_usbmouse.
+ *
+ * Copyright (C) 2015 Marcus Menzel <codingmax@gmx-topmail.de>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ * http://www.gnu.org/licenses/gpl-2.0.html
+ */
+
+/* Build: see run.sh. The backend is included for its static functions,
+ * as in ctrl_multi without a main(). */
+
+#define _GNU_SOURCE
+#define CTRL_MULTI
+
+#include <fcntl.h>
+#include <pthread.h>
+
+#include "../ctrl_usbmouse.c"
+
+static int failed = 0;
+
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+		fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+		failed++; \
+	} \
+} while (0)
+
+
+/* ---- ring ---- */
+
+#define RING_NB 100000
+
+static void * produce(void *arg) {
+
+	Ring *ring = arg;
+	int i;
+	for (i = 0; i < RING_NB; i++)
+		while (!ring_put(ring, &i))
+			sched_yield();
+	return NULL;
+}
+
+
+static void test_ring() {
+
+	CHECK(ring_new(sizeof(int), 0) == NULL);
+	CHECK(ring_new(0, 8) == NULL);
+
+	/* 5 units are rounded up to 8 */
+	Ring *ring = ring_new(sizeof(int), 5);
+	CHECK(ring != NULL);
+	if (ring == NULL)
+		return;
+
+	int i, v;
+	CHECK(!ring_get(ring, &v));
+	for (i = 0; i < 8; i++)
+		CHECK(ring_put(ring, &i));
+	CHECK(!ring_put(ring, &i));
+
+	struct pollfd pfd = { ring_fd(ring), POLLIN, 0 };
+	CHECK(poll(&pfd, 1, 0) == 1);
+
+	for (i = 0; i < 8; i++)
+		CHECK(ring_get(ring, &v) && v == i);
+	CHECK(!ring_get(ring, &v));
+	CHECK(poll(&pfd, 1, 0) == 0);
+
+	/* across the end of the buffer */
+	for (i = 0; i < 20; i++) {
+		CHECK(ring_put(ring, &i));
+		CHECK(ring_get(ring, &v) && v == i);
+	}
+
+	/* one producer thread, the consumer woken up through the eventfd */
+	pthread_t thread;
+	CHECK(pthread_create(&thread, NULL, produce, ring) == 0);
+	int next = 0, inOrder = 1;
+	while (next < RING_NB && inOrder && poll(&pfd, 1, 5000) == 1)
+		while (inOrder && ring_get(ring, &v))
+			inOrder = v == next++;
+	CHECK(inOrder && next == RING_NB);
+	pthread_join(thread, NULL);
+	ring_free(ring);
+}
+
+
+/* ---- report descriptors and reports ---- */
+
+/* report 2: 5 buttons, x and y, wheel and AC pan of 8 bits each */
+static const unsigned char mouseDesc[] = {
+	0x05, 0x01, 0x09, 0x02, 0xa1, 0x01, 0x85, 0x02, 0x09, 0x01, 0xa1, 0x00,
+	0x05, 0x09, 0x19, 0x01, 0x29, 0x05, 0x15, 0x00, 0x25, 0x01, 0x95, 0x05,
+	0x75, 0x01, 0x81, 0x02, 0x95, 0x01, 0x75, 0x03, 0x81, 0x01, 0x05, 0x01,
+	0x09, 0x30, 0x09, 0x31, 0x15, 0x81, 0x25, 0x7f, 0x75, 0x08, 0x95, 0x02,
+	0x81, 0x06, 0x09, 0x38, 0x15, 0x81, 0x25, 0x7f, 0x75, 0x08, 0x95, 0x01,
+	0x81, 0x06, 0x05, 0x0c, 0x0a, 0x38, 0x02, 0x95, 0x01, 0x81, 0x06, 0xc0,
+	0xc0
+};
+
+/* without ids: 3 buttons, 12 bits of x and y, wheel of 4 bits */
+static const unsigned char packedDesc[] = {
+	0x05, 0x01, 0x09, 0x02, 0xa1, 0x01, 0x05, 0x09, 0x19, 0x01, 0x29, 0x03,
+	0x15, 0x00, 0x25, 0x01, 0x95, 0x03, 0x75, 0x01, 0x81, 0x02, 0x95, 0x01,
+	0x75, 0x01, 0x81, 0x01, 0x05, 0x01, 0x09, 0x30, 0x09, 0x31, 0x16, 0x01,
+	0xf8, 0x26, 0xff, 0x07, 0x75, 0x0c, 0x95, 0x02, 0x81, 0x06, 0x09, 0x38,
+	0x15, 0xf8, 0x25, 0x07, 0x75, 0x04, 0x95, 0x01, 0x81, 0x06, 0xc0
+};
+
+
+static void test_get_bits() {
+
+	const unsigned char buf[] = { 0x12, 0x34, 0xF0, 0xFF };
+
+	CHECK(get_bits(buf, 0, 8, 0) == 0x12);
+	CHECK(get_bits(buf, 1, 1, 0) == 1);
+	CHECK(get_bits(buf, 0, 1, 0) == 0);
+	CHECK(get_bits(buf, 4, 8, 0) == 0x41);
+	CHECK(get_bits(buf, 8, 16, 0) == 0xF034);
+	CHECK(get_bits(buf, 16, 8, 1) == -16);
+	CHECK(get_bits(buf, 16, 8, 0) == 0xF0);
+	CHECK(get_bits(buf, 20, 4, 1) == -1);
+	CHECK(get_bits(buf, 12, 12, 1) == -253);
+	CHECK(get_bits(buf, 8, 24, 1) == -4044);
+	CHECK(get_bits(buf, 0, 7, 1) == 0x12);
+}
+
+
+static void test_compile_plan() {
+
+	Plan plan;
+
+	CHECK(compile_plan(&plan, mouseDesc, sizeof(mouseDesc)));
+	CHECK(plan.hasIds && plan.hasWheel && plan.hasPan);
+	CHECK(plan.reportLen == 6);
+	CHECK(plan.opNb == 3);
+	CHECK(plan.op[0].type == OP_BUTTONS && plan.op[0].reportId == 2);
+	CHECK(plan.op[0].bit == 8 && plan.op[0].size == 5 && plan.op[0].shift == 0);
+	CHECK(plan.op[1].type == OP_WHEEL && plan.op[1].bit == 32 && plan.op[1].size == 8);
+	CHECK(plan.op[1].isSigned && plan.op[1].need == 5);
+	CHECK(plan.op[2].type == OP_PAN && plan.op[2].bit == 40 && plan.op[2].need == 6);
+
+	CHECK(compile_plan(&plan, packedDesc, sizeof(packedDesc)));
+	CHECK(!plan.hasIds && plan.hasWheel && !plan.hasPan);
+	CHECK(plan.reportLen == 4);
+	CHECK(plan.opNb == 2);
+	CHECK(plan.op[0].type == OP_BUTTONS && plan.op[0].bit == 0 && plan.op[0].size == 3);
+	CHECK(plan.op[1].type == OP_WHEEL && plan.op[1].bit == 28 && plan.op[1].size == 4);
+	CHECK(plan.op[1].isSigned && plan.op[1].need == 4);
+
+	/* malformed: cut item, report id 0, more than REPORT_MAX bytes */
+	CHECK(!compile_plan(&plan, mouseDesc, 5));
+	const unsigned char idZero[] = { 0x85, 0x00 };
+	CHECK(!compile_plan(&plan, idZero, sizeof(idZero)));
+	const unsigned char tooLong[] = { 0x05, 0x09, 0x09, 0x01, 0x75, 0x20, 0x96, 0x01, 0x01, 0x81, 0x02 };
+	CHECK(!compile_plan(&plan, tooLong, sizeof(tooLong)));
+}
+
+
+static void test_get_input() {
+
+	settings = calloc(1, sizeof(Settings));
+	if (settings == NULL) {
+		failed++;
+		return;
+	}
+	settings->statShort = -1;
+	settings->statOther = -1;
+
+	Mouse m;
+	memset(&m, 0, sizeof(m));
+	CHECK(compile_plan(&m.plan, mouseDesc, sizeof(mouseDesc)));
+
+	int wheel, pan;
+	const unsigned char report[] = { 0x02, 0x01, 0x00, 0x00, 0x01, 0xff };
+	CHECK(get_input(&m, report, sizeof(report), &wheel, &pan));
+	CHECK(m.buttons == 1 && wheel == 1 && pan == -1);
+
+	/* too short for the pan, other id */
+	const unsigned char cut[] = { 0x02, 0x03, 0x00, 0x00, 0xfe };
+	CHECK(!get_input(&m, cut, sizeof(cut), &wheel, &pan));
+	CHECK(m.buttons == 3);
+	const unsigned char other[] = { 0x03, 0x00, 0x00, 0x00, 0x00, 0x00 };
+	CHECK(!get_input(&m, other, sizeof(other), &wheel, &pan));
+	CHECK(m.buttons == 3 && wheel == 0 && pan == 0);
+
+	/* -b and -w: only the bytes up to the higher index are needed */
+	settings->byteIdx = 1;
+	m.buttonIdx = 1;
+	m.wheelIdx = 2;
+	const unsigned char bytes[] = { 0x00, 0x05, 0xfd };
+	CHECK(get_input(&m, bytes, sizeof(bytes), &wheel, &pan));
+	CHECK(m.buttons == 5 && wheel == -3);
+	CHECK(!get_input(&m, bytes, 2, &wheel, &pan));
+
+	free(settings);
+	settings = NULL;
+}
+
+
+/* ---- output queue ---- */
+
+/* stdout is a pipe that is full until drain() */
+static int outPipe[2];
+
+/* Returns the bytes written until the pipe is full. */
+static int fill_pipe() {
+
+	char c = 0;
+	int nb = 0;
+	while (write(1, &c, 1) == 1)
+		nb++;
+	return nb;
+}
+
+
+/* Reads the pipe until it is empty, returns the bytes after skip bytes. */
+static int drain(int skip, char *buf, int size) {
+
+	int nb = 0;
+	char c;
+	while (read(outPipe[0], &c, 1) == 1) {
+		if (skip > 0)
+			skip--;
+		else if (nb < size)
+			buf[nb++] = c;
+	}
+	return nb;
+}
+
+
+static void * drain_later(void *arg) {
+
+	usleep(100000);
+	char buf[16];
+	drain(0, buf, sizeof(buf));
+	return NULL;
+}
+
+
+/* Queues "aaa", "bbb" and "ccc" in 8 bytes and returns what stdout gets. */
+static int run_policy(OutPolicy policy, char *got, int size, OutStats *stats) {
+
+	int fill = fill_pipe();
+	if (!init_output(8, policy))
+		return -1;
+
+	pthread_t thread;
+	int threaded = policy == OUT_BLOCK && pthread_create(&thread, NULL, drain_later, NULL) == 0;
+	CHECK(out_write("aaa", 3) && out_write("bbb", 3) && out_write("ccc", 3));
+	if (threaded)
+		pthread_join(thread, NULL);
+
+	int nb = threaded ? 0 : drain(fill, got, size);
+	while (out_pending()) {
+		CHECK(out_flush());
+		nb += drain(0, got + nb, size - nb);
+	}
+	out_get_stats(stats);
+	free_output();
+	return nb;
+}
+
+
+static void test_output() {
+
+	int savedOut = dup(1);
+	if (savedOut < 0 || pipe2(outPipe, O_NONBLOCK) != 0 || dup2(outPipe[1], 1) < 0) {
+		failed++;
+		return;
+	}
+	fcntl(outPipe[1], F_SETPIPE_SZ, 4096);
+
+	char got[16];
+	OutStats s;
+
+	int nb = run_policy(OUT_DROP_OLDEST, got, sizeof(got), &s);
+	CHECK(nb == 6 && memcmp(got, "bbbccc", 6) == 0);
+	CHECK(s.units == 3 && s.droppedOldest == 1);
+
+	nb = run_policy(OUT_DROP_NEWEST, got, sizeof(got), &s);
+	CHECK(nb == 6 && memcmp(got, "aaabbb", 6) == 0);
+	CHECK(s.droppedNewest == 1);
+
+	nb = run_policy(OUT_COALESCE, got, sizeof(got), &s);
+	CHECK(nb == 3 && memcmp(got, "ccc", 3) == 0);
+	CHECK(s.coalesced == 1);
+
+	/* the units go out behind the filling, taken by the thread */
+	run_policy(OUT_BLOCK, got, sizeof(got), &s);
+	CHECK(s.blocked >= 1 && s.droppedOldest + s.droppedNewest + s.coalesced == 0);
+
+	dup2(savedOut, 1);
+	close(savedOut);
+	close(outPipe[0]);
+	close(outPipe[1]);
+}
+
+
+/* ---- capture ---- */
+
+typedef struct Replayed {
+	int nb;
+	int ok;
+} Replayed;
+
+static int check_record(int type, const unsigned char *buf, int nb, const struct timespec *at, void *data) {
+
+	Replayed *r = data;
+	int i;
+	int ok = type == r->nb + 1 && nb == (r->nb == 2 ? CAP_DATA_MAX : r->nb * 3);
+	for (i = 0; i < nb && ok; i++)
+		ok = buf[i] == (unsigned char)(type + i);
+	r->ok += ok;
+	r->nb++;
+	return 1;
+}
+
+
+static void test_capture() {
+
+	char path[] = "/tmp/test_units_XXXXXX";
+	int fd = mkstemp(path);
+	if (fd < 0) {
+		failed++;
+		return;
+	}
+	close(fd);
+	unlink(path);
+
+	unsigned char buf[CAP_DATA_MAX];
+	int type, i;
+
+	CHECK(cap_open(path));
+	for (type = 1; type <= 3; type++) {
+		int nb = type == 3 ? CAP_DATA_MAX : (type - 1) * 3;
+		for (i = 0; i < nb; i++)
+			buf[i] = type + i;
+		cap_write(type, buf, nb);
+	}
+	cap_close();
+
+	/* a record cut off at the end is skipped */
+	fd = open(path, O_WRONLY | O_APPEND);
+	CHECK(fd >= 0 && write(fd, buf, 12) == 12);
+	close(fd);
+
+	Replayed r = { 0, 0 };
+	CHECK(loop_init());
+	CHECK(cap_replay(path, 0, check_record, &r));
+	CHECK(loop_run());
+	CHECK(r.nb == 3 && r.ok == 3);
+	cap_close();
+	loop_free();
+
+	/* appending needs the same version and whole records */
+	CHECK(!cap_open(path));
+	unlink(path);
+}
+
+
+int main(int argc, char *argv[]) {
+
+	if (!init_util("test_units", argc, argv, ":"))
+		return 1;
+
+	test_ring();
+	test_get_bits();
+	test_compile_plan();
+	test_get_input();
+	test_output();
+	test_capture();
+
+	free_util();
+	if (failed > 0)
+		fprintf(stderr, "test_units: %d checks failed.\n", failed);
+	return failed > 0;
+}
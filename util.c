@@ -20,6 +20,8 @@
  */
 
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -27,6 +29,16 @@
 #include <signal.h>
 #include <stdarg.h>
 #include <syslog.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
 
 #include "util.h"
 
@@ -55,48 +67,355 @@ typedef struct Settings {
 	int argNb;
 	int stop;
 	int testmode;
+
+	/* the command line, parsed again with the config file */
+	int argc;
+	char **argv;
+	char *optString;
 	
 } Settings;
 
+/* options read from the file of init_config() */
+typedef struct Config {
+	char *path;
+	int (*reload)();
+	char *text;       /* the file, option values point into it */
+	char **argv;
+	char *firstText;  /* read by init_config(), kept until the end */
+} Config;
+
+/* Units written with out_write() are queued in a ring of bytes and a ring
+ * of unit lengths. A unit that was only partly written is moved to the
+ * separate 'partial' buffer, so all units in the rings can be dropped
+ * without breaking up a unit on stdout. */
+#define OUT_UNITS_MAX 65536  /* queued units, even if they are 1 byte each */
+
+typedef struct Output {
+	OutPolicy policy;
+	int size;
+	int unitSize;       /* length of the ring of unit lengths */
+
+	unsigned char *buf;
+	int head;
+	int len;
+
+	int *units;
+	int unitHead;
+	int unitNb;
+
+	unsigned char *partial;
+	int partialPos;
+	int partialLen;
+
+	int epollState;     /* -1: not added, 0: added, 1: waiting for EPOLLOUT, 2: can't poll */
+	OutStats stats;
+} Output;
+
+#define LOOP_SOURCE_MAX 64
+#define LOOP_DEFER_MAX 16
+#define LOOP_EVENT_MAX 16
+
+enum { SOURCE_FREE, SOURCE_FD, SOURCE_TIMER, SOURCE_SIGNAL, SOURCE_STDOUT, SOURCE_CLOSED };
+
+/* epoll data points to the source. Removed sources are only marked closed
+ * during a round, so later events of the same epoll_wait() can't hit a
+ * reused slot. */
+typedef struct Source {
+	int type;
+	int owner;        /* see loop_set_owner() */
+	int fd;
+	LoopFdCb fdCb;
+	LoopTimerCb timerCb;
+	void *data;
+	int intervalMs;   /* of a periodic timer, for the jitter statistics */
+	struct timespec lastExp;
+} Source;
+
+typedef struct Deferred {
+	LoopCb cb;
+	void *data;
+	int owner;
+} Deferred;
+
+typedef struct Loop {
+	int epollFd;
+	int stop;
+	Source source[LOOP_SOURCE_MAX];
+	Deferred deferred[LOOP_DEFER_MAX];
+	int deferredNb;
+	int owner;        /* of the source being dispatched or being added */
+	int running;      /* messages are flushed at the end of a round */
+	int statCallback; /* statistics of the loop itself */
+	int statJitter;
+	int statEvents;
+} Loop;
+
+/* Names are not copied, they have to be string literals. */
+typedef struct Stat {
+	const char *name;
+	int histogram;
+	unsigned long count;
+	unsigned long sum;
+	unsigned long max;
+	unsigned long bucket[STAT_BUCKETS];
+} Stat;
+
+#define LOG_LINE 256
+#define LOG_BUF 8192
+#define LOG_BURST 20         /* messages in a row before rate limiting */
+#define LOG_RATE_MS 100      /* then one message per LOG_RATE_MS */
+#define LOG_REPEAT_MS 10000  /* repetitions are reported at least that often */
+
+/* Messages are formatted into buf and written by log_flush() - at the
+ * end of a round of the loop, or right away while the loop doesn't run.
+ * Nothing is allocated per message. */
+typedef struct Logger {
+	char buf[LOG_BUF];
+	int len;
+	char last[LOG_LINE];  /* text of the last printed message */
+	int repeated;         /* times last was suppressed as a repetition */
+	struct timespec repeatStart;
+	int limited;          /* messages suppressed by the rate limit */
+	int tokens;
+	struct timespec refill;
+	int useSyslog;        /* stderr failed */
+} Logger;
+
+#define TRACE_BUF 16384
+
+typedef struct Tracer {
+	char buf[TRACE_BUF];
+	int len;
+} Tracer;
+
 static Settings * settings = NULL;
+static Output * output = NULL;
+static Loop * loop = NULL;
+static int (*outMap)(int owner, const unsigned char *buf, int nb) = NULL;
+static LoopCb outIdleCb = NULL;    /* see out_on_idle() */
+static void *outIdleData = NULL;
+static int outIdleOwner = 0;
+static Stat stats[STAT_MAX];
+static int statNb = 0;
+static Logger logger = { .tokens = LOG_BURST };
+static Config config = { NULL, NULL, NULL, NULL, NULL };
+static int optReplace = 0;  /* add_opt() replaces the values of given options */
+static Tracer tracer;
+
+#define CAP_MAGIC "CTRLCAP1"
+#define CAP_VERSION 1
+#define CAP_BUF 16384
+#define CAP_BATCH 256      /* records per round when replaying as fast as possible */
+#define CAP_DRAIN_MS 10    /* polling stdout after the last record */
+
+/* A capture file is a header and records, all 8 byte aligned, so a mapped
+ * file can be read in place. Integers are in host byte order. Every
+ * cap_open() appends a CAP_START record, the replay restarts its clock
+ * there. */
+typedef struct CapHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t recordSize;   /* of CapRecord */
+} CapHeader;
+
+typedef struct CapRecord {
+	uint64_t ns;           /* CLOCK_MONOTONIC */
+	uint16_t type;
+	uint16_t len;          /* of the data that follows, padded to 8 bytes */
+	uint32_t owner;        /* see loop_set_owner() */
+} CapRecord;
+
+/* Records are collected in buf and written at the end of a round of the
+ * loop, like the trace. */
+typedef struct Capture {
+	int fd;
+	unsigned char buf[CAP_BUF] __attribute__ ((aligned(8)));
+	int len;
+} Capture;
+
+typedef struct Replay {
+	unsigned char *map;
+	size_t size;
+	size_t pos;
+	int timer;
+	int speed;
+	CapCb cb;
+	void *data;
+	uint64_t baseNs;       /* recorded time of start */
+	struct timespec start;
+	struct timespec began; /* of the replay */
+	unsigned long records;
+} Replay;
+
+static Capture capture = { .fd = -1 };
+static Replay replay = { .map = NULL };
+
+#define CACHE_LINE 64
+
+/* Producer and consumer each write their own cache line and keep a copy
+ * of the other index, so they only share a line when the ring looks full
+ * or empty. */
+struct Ring {
+	unsigned long tail __attribute__ ((aligned(CACHE_LINE)));
+	unsigned long headCopy;
+
+	unsigned long head __attribute__ ((aligned(CACHE_LINE)));
+	unsigned long tailCopy;
+
+	unsigned long mask __attribute__ ((aligned(CACHE_LINE)));
+	int unitSize;
+	int fd;
+	unsigned char *buf;
+};
+
+/* options of the program while a scope of push_opts() is current */
+static Option * savedOption = NULL;
+static Argument * savedArgument = NULL;
+static int savedArgNb = 0;
+static int optsPushed = 0;
 static char * prog = "util";
 static void (*externalSignalHandler)(int);
 
 
-/* writes to stderr, fallback: syslog */
-void msg(const char *format, ...) {
-	static int log = 0;
-	
-	int nb = 0;
-		
-	if (!log) {
+static long us_between(const struct timespec *from, const struct timespec *to);
+static void cap_flush();
 
-		fprintf(stderr, "%s: ", prog);
-		
-		va_list args;
-		va_start(args,format);
-		nb = vfprintf(stderr, format, args);
-		va_end(args);
-		
-		if (nb < 0) {
-			log = 1;
+
+/* Writes the buffered messages to stderr, fallback: syslog */
+static void log_flush() {
+
+	int pos = 0;
+	while (!logger.useSyslog && pos < logger.len) {
+		int nb = write(2, logger.buf + pos, logger.len - pos);
+		if (nb > 0) {
+			pos += nb;
+		} else if (nb < 0 && errno == EAGAIN) {
+			/* stderr may share the non-blocking file of stdout */
+			struct pollfd pfd = { 2, POLLOUT, 0 };
+			poll(&pfd, 1, -1);
+		} else if (nb < 0 && errno != EINTR) {
+			logger.useSyslog = 1;
 			openlog(prog, LOG_PID, LOG_USER);
-		} else
-			fprintf(stderr, "\n");
+		}
+	}
+
+	/* lines not written to stderr, without the prefix */
+	while (pos < logger.len) {
+		char *line = logger.buf + pos;
+		char *end = memchr(line, '\n', logger.len - pos);
+		*end = '\0';
+		char *text = strstr(line, ": ");
+		syslog(LOG_ERR, "%s", text != NULL ? text + 2 : line);
+		pos = end + 1 - logger.buf;
 	}
+	logger.len = 0;
+}
+
+
+static void log_line(const char *format, ...) __attribute__ ((format(__printf__, 1, 2)));
+
+static void log_line(const char *format, ...) {
+
+	if (LOG_BUF - logger.len < LOG_LINE + 64)
+		log_flush();
+
+	int max = LOG_BUF - logger.len - 1;
+	int nb = snprintf(logger.buf + logger.len, max, "%s: ", prog);
+
+	va_list args;
+	va_start(args,format);
+	nb += vsnprintf(logger.buf + logger.len + nb, max - nb, format, args);
+	va_end(args);
+
+	if (nb > max - 1)
+		nb = max - 1;
+	logger.buf[logger.len + nb] = '\n';
+	logger.len += nb + 1;
+}
+
+
+static void log_repeated() {
+
+	if (logger.repeated > 0)
+		log_line("last message repeated %d times", logger.repeated);
+	logger.repeated = 0;
+}
+
 
-	if (log) {
+static void log_suppressed() {
 
-		char * str = NULL;
-		va_list args;
-		va_start(args,format);
-		int len = vasprintf(&str, format,args);
-		va_end(args);
-		if (len >= 0) {
-			syslog(LOG_ERR, "%s", str);		
-			free(str);
-		}	
+	if (logger.limited > 0)
+		log_line("%d messages suppressed", logger.limited);
+	logger.limited = 0;
+}
+
+
+/* ms until the count of a repeated message is due, -1: none is pending.
+ * The loop waits at most that long, so the count shows up without a
+ * further message. */
+static int log_timeout() {
+
+	if (logger.repeated == 0)
+		return -1;
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	long ms = LOG_REPEAT_MS - us_between(&logger.repeatStart, &now) / 1000;
+	if (ms > 0)
+		return ms;
+
+	log_repeated();
+	return 0;
+}
+
+
+/* Writes to stderr, fallback: syslog. A repeated message is counted and
+ * reported as "last message repeated N times". While the loop runs, more
+ * than LOG_BURST messages in a row are rate limited. */
+void msg(const char *format, ...) {
+
+	char text[LOG_LINE];
+	va_list args;
+	va_start(args,format);
+	vsnprintf(text, sizeof(text), format, args);
+	va_end(args);
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	int running = loop != NULL && loop->running;
+
+	if (strcmp(text, logger.last) == 0) {
+		if (logger.repeated++ == 0)
+			logger.repeatStart = now;
+		if (us_between(&logger.repeatStart, &now) >= LOG_REPEAT_MS * 1000L)
+			log_repeated();
+		if (!running)
+			log_flush();
+		return;
+	}
+	log_repeated();
+
+	long refills = us_between(&logger.refill, &now) / (LOG_RATE_MS * 1000L);
+	if (refills > 0) {
+		logger.tokens = refills >= LOG_BURST ? LOG_BURST : logger.tokens + refills;
+		if (logger.tokens > LOG_BURST)
+			logger.tokens = LOG_BURST;
+		logger.refill = now;
+	}
+
+	if (running && logger.tokens == 0) {
+		logger.limited++;
+		return;
 	}
+	if (logger.tokens > 0)
+		logger.tokens--;
+
+	log_suppressed();
+	log_line("%s", text);
+	/* only a printed message can be repeated */
+	strcpy(logger.last, text);
+	if (!running)
+		log_flush();
 }
 
 
@@ -105,6 +424,10 @@ static int add_opt(char key, char *value) {
 	Option ** addr;
 	for (addr = &settings->firstOption; *addr != NULL; addr = &(*addr)->next) 
 		if ((*addr)->key == key) {
+			if (optReplace) {
+				(*addr)->value = value;
+				return 0;
+			}
 			error("Option '-%c' was set multiple times.",key); 
 			return -1;
 		}
@@ -140,33 +463,65 @@ static int add_arg(char *value) {
 }
 
 
-static void free_settings() {
+static void free_opt_list(Option *opt, Argument *arg) {
 
-	Option * opt;
 	Option * nextOpt;
-	for (opt = settings->firstOption; opt != NULL; opt = nextOpt) {
+	for (; opt != NULL; opt = nextOpt) {
 		nextOpt = opt->next;
 		free(opt);
 	}
-	settings->firstOption = NULL;
 	
-	Argument * arg;
 	Argument * nextArg;
-	for (arg = settings->firstArgument; arg != NULL; arg = nextArg) {
+	for (; arg != NULL; arg = nextArg) {
 		nextArg = arg->next;
 		free(arg);
 	}
+}
+
+
+static void free_opts() {
+
+	free_opt_list(settings->firstOption, settings->firstArgument);
+	settings->firstOption = NULL;
 	settings->firstArgument = NULL;
 	settings->argNb = 0;
-	settings->stop = 1;
 }
 
-static void signalHandler(int sig) {
-	char * sigStr = strsignal(sig); /* no free */
-	info("Signal %d (%s) caught.",sig,sigStr);
+
+static void free_settings() {
+	free_opts();
 	settings->stop = 1;
-	if (externalSignalHandler) 
-		externalSignalHandler(sig);
+}
+
+
+static int parse_opts(int argc, char *argv[], char *optString) {
+
+	int opt;
+	int err = 0;
+	
+	while (!err && (opt = getopt (argc, argv, optString)) != EOF) {
+		switch (opt) {	
+			case ':':
+				error("Option '-%c' requires a value.",optopt);
+				err = 1;				
+				break;
+            case '?':
+				error("Unknown option: '-%c'",optopt);
+				err = 1;				
+				break;
+            default:
+				if (add_opt(opt,optarg) == -1)
+					err = 1;
+		}
+	}
+
+	int i;
+	for (i = 0; !err && i < argc-optind; i++) {
+		char * value = argv[optind + i];
+		if (add_arg(value) == -1)
+			err = 1;
+	}
+	return !err;
 }
 
 static int init_settings(char * progname, int argc, char *argv[], char *optString) {
@@ -196,44 +551,22 @@ static int init_settings(char * progname, int argc, char *argv[], char *optStrin
 	settings->argNb = 0;
 	settings->stop = 0;
 	settings->testmode = 0;
+	settings->argc = argc;
+	settings->argv = argv;
+	settings->optString = optString;
 	
-	int opt;
-	int err = 0;
-	
-	while (!err && (opt = getopt (argc, argv, optString)) != EOF) {
-		switch (opt) {	
-			case ':':
-				error("Option '-%c' requires a value.",optopt);
-				err = 1;				
-				break;
-            case '?':
-				error("Unknown option: '-%c'",optopt);
-				err = 1;				
-				break;
-            default:
-				if (add_opt(opt,optarg) == -1)
-					err = 1;
-		}
-	}
-
-	int i;
-	for (i = 0; !err && i < argc-optind; i++) {
-		char * value = argv[optind + i];
-		if (add_arg(value) == -1)
-			err = 1;
-	}
+	int err = !parse_opts(argc, argv, optString);
 
 	if (err)
 		free_util();
 	else {
-		signal(SIGHUP, signalHandler);
-		signal(SIGTERM, signalHandler);
-		signal(SIGPIPE, signalHandler);
-		
+		/* the other signals are taken over by loop_init() */
 		settings->testmode = get_opt_str('t', 0, NULL) == 1 ? 1 : 0;
 		
-		signal(SIGINT, settings->testmode ? signalHandler : SIG_IGN);
-		signal(SIGQUIT, settings->testmode ? signalHandler : SIG_IGN);
+		if (!settings->testmode) {
+			signal(SIGINT, SIG_IGN);
+			signal(SIGQUIT, SIG_IGN);
+		}
 	}
 	
 	if (err) {
@@ -307,6 +640,36 @@ int get_opt_int_between(char key, int withErrorMsg, int from, int to, int dflt,
 }
 
 
+/* Reads a list like '-b 0,3,1' into nb integers from [from..to]. A single
+ * value is used for all of them, a missing option means dflt for all. */
+int get_opt_int_list(char key, int withErrorMsg, int from, int to, int dflt, int nb, int *ints) {
+
+	char *str;
+	char **items = NULL;
+	int i;
+
+	if (!get_opt_str(key, 0, &str)) {
+		for (i = 0; i < nb; i++)
+			ints[i] = dflt;
+		return 1;
+	}
+
+	int itemNb = split_str(str, ',', &items);
+	int ok = (itemNb == 1 || itemNb == nb);
+	
+	for (i = 0; ok && i < nb; i++) 
+		if (!str_to_int(items[itemNb == 1 ? 0 : i], &ints[i]) || ints[i] < from || ints[i] > to)
+			ok = 0;
+
+	free(items);
+
+	if (!ok && withErrorMsg)
+		error("Value of option '-%c' is not 1 or %d comma separated integers from [%d..%d].", 
+				key, nb, from, to);
+	return ok;
+}
+
+
 int get_args(char ***args) {
 	
 	if (settings->argNb <= 0) {	
@@ -349,6 +712,40 @@ char * make_str(const char *format, ...)
 }
 
 
+/* Splits str at every sep. *items and the copied strings it points to are
+ * allocated as one block, so a single free(*items) releases them.
+ * Returns the number of items or -1. */
+int split_str(const char *str, char sep, char ***items) {
+
+	int nb = 1;
+	const char *c;
+	for (c = str; *c != '\0'; c++)
+		if (*c == sep)
+			nb++;
+
+	char **lst = malloc(nb * sizeof(char*) + strlen(str) + 1);
+	if (lst == NULL) {
+		noMem();
+		*items = NULL;
+		return -1;
+	}
+
+	char *copy = (char*)(lst + nb);
+	strcpy(copy, str);
+
+	int i = 0;
+	lst[i++] = copy;
+	for (; *copy != '\0'; copy++)
+		if (*copy == sep) {
+			*copy = '\0';
+			lst[i++] = copy + 1;
+		}
+
+	*items = lst;
+	return nb;
+}
+
+
 int str_to_int(char *str, int * intPtr) {
 	char * endptr;
 	long lval = strtol (str, &endptr, 10);
@@ -360,32 +757,101 @@ int str_to_int(char *str, int * intPtr) {
 }
 
 
-char * get_bin_str(unsigned char val) {
+static const char nibbleBits[16][4] = {
+	"0000", "0001", "0010", "0011", "0100", "0101", "0110", "0111",
+	"1000", "1001", "1010", "1011", "1100", "1101", "1110", "1111"
+};
+
+static const char hexDigits[] = "0123456789abcdef";
+
+
+/* buf needs BIN_STR_LEN chars */
+char * get_bin_str(unsigned char val, char *buf) {
 	
-	char *str = malloc(9*sizeof(char));
-	if (str == NULL) {
-		noMem();
-		return NULL;
-	}
-	int i;
-	for (i = 0; i < 8; i++)
-		str[i] = (val & (1<<(7-i))) ? '1' : '0';
-	str[8] = '\0';
-	return str;
+	memcpy(buf, nibbleBits[val >> 4], 4);
+	memcpy(buf + 4, nibbleBits[val & 0x0F], 4);
+	buf[8] = '\0';
+	return buf;
 }
 
 
-char * get_multi_base_str(unsigned char val) {
-	
-	char * str = NULL;
-	char * binStr = get_bin_str(val);
+static char * put_str(char *p, const char *str) {
+	while (*str)
+		*p++ = *str++;
+	return p;
+}
+
+
+/* Like "bin:%s oct:0%03o hex:%02x  dec:%3d  char:'%c'", or char:'\x%02x'
+ * for bytes that are not printable. buf needs MULTI_BASE_STR_LEN chars. */
+char * get_multi_base_str(unsigned char val, char *buf) {
 	
-	if (val >= 0x20 && val < 0x7f)
-		str = make_str("bin:%s oct:0%03o hex:%02x  dec:%3d  char:'%c'",binStr,val,val,val,val);
-	else
-		str = make_str("bin:%s oct:0%03o hex:%02x  dec:%3d  char:'\\x%02x'",binStr,val,val,val,val);
-	free(binStr);
-	return str;
+	char *p = put_str(buf, "bin:");
+	get_bin_str(val, p);
+	p = put_str(p + 8, " oct:0");
+	*p++ = '0' + (val >> 6);
+	*p++ = '0' + ((val >> 3) & 7);
+	*p++ = '0' + (val & 7);
+	p = put_str(p, " hex:");
+	*p++ = hexDigits[val >> 4];
+	*p++ = hexDigits[val & 0x0F];
+	p = put_str(p, "  dec:");
+	*p++ = val >= 100 ? '0' + val / 100 : ' ';
+	*p++ = val >= 10 ? '0' + val / 10 % 10 : ' ';
+	*p++ = '0' + val % 10;
+	p = put_str(p, "  char:'");
+	if (val >= 0x20 && val < 0x7f) {
+		*p++ = val;
+	} else {
+		p = put_str(p, "\\x");
+		*p++ = hexDigits[val >> 4];
+		*p++ = hexDigits[val & 0x0F];
+	}
+	*p++ = '\'';
+	*p = '\0';
+	return buf;
+}
+
+
+void trace_flush() {
+
+	if (tracer.len == 0)
+		return;
+
+	/* lines printed before with stdio come first */
+	fflush(stdout);
+
+	int pos = 0;
+	while (pos < tracer.len) {
+		int nb = write(1, tracer.buf + pos, tracer.len - pos);
+		if (nb > 0) {
+			pos += nb;
+		} else if (nb < 0 && errno == EAGAIN) {
+			struct pollfd pfd = { 1, POLLOUT, 0 };
+			poll(&pfd, 1, -1);
+		} else if (nb < 0 && errno != EINTR) {
+			break;  /* nobody is reading the trace */
+		}
+	}
+	tracer.len = 0;
+}
+
+
+void trace(const char *format, ...) {
+
+	if (TRACE_BUF - tracer.len < TRACE_LINE_LEN)
+		trace_flush();
+
+	va_list args;
+	va_start(args,format);
+	int nb = vsnprintf(tracer.buf + tracer.len, TRACE_BUF - tracer.len, format, args);
+	va_end(args);
+
+	if (nb > 0)
+		tracer.len += nb < TRACE_BUF - tracer.len ? nb : TRACE_BUF - tracer.len - 1;
+
+	if (loop == NULL || !loop->running)
+		trace_flush();
 }
 
 
@@ -394,6 +860,7 @@ int init_util(char * progname, int argc, char *argv[], char *optString) {
 }
 
 
+/* signalHandler is called from loop_run(), not from signal context. */
 int init_util_sig(char * progname, int argc, char *argv[], char *optString, void (*signalHandler)(int)) {
 	int r = init_settings(progname, argc, argv, optString);
 	if (r != 0)
@@ -407,6 +874,1478 @@ void free_util() {
 }
 
 
-int stopped_by_signal() {
-	return settings->stop;
+/* Makes the options of argv current - argv[0] is skipped as by getopt() -
+ * until pop_opts(). Used to set up several controllers in one process.
+ * Scopes don't nest. */
+int push_opts(char *optString, int argc, char *argv[]) {
+
+	if (optsPushed) {
+		error("Options pushed twice.");
+		return 0;
+	}
+
+	savedOption = settings->firstOption;
+	savedArgument = settings->firstArgument;
+	savedArgNb = settings->argNb;
+	settings->firstOption = NULL;
+	settings->firstArgument = NULL;
+	settings->argNb = 0;
+	optsPushed = 1;
+
+	/* 0 makes getopt() start from scratch */
+	optind = 0;
+	if (!parse_opts(argc, argv, optString)) {
+		pop_opts();
+		return 0;
+	}
+	return 1;
+}
+
+
+void pop_opts() {
+
+	if (!optsPushed)
+		return;
+
+	free_opts();
+	settings->firstOption = savedOption;
+	settings->firstArgument = savedArgument;
+	settings->argNb = savedArgNb;
+	optsPushed = 0;
+}
+
+
+/* Reads the options of the config file into text and argv, split at white
+ * space. '#' starts a comment. */
+static int read_config(char **text, char ***argv, int *argc) {
+
+	int fd = open(config.path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		int err = errno;
+		error("Can't open config file '%s': %s.", config.path, strerror(err));
+		return 0;
+	}
+
+	int size = 4096;
+	int len = 0;
+	char *buf = NULL;
+	int nb;
+	do {
+		char *b = realloc(buf, size + 1);
+		if (b == NULL) {
+			noMem();
+			free(buf);
+			close(fd);
+			return 0;
+		}
+		buf = b;
+		nb = read(fd, buf + len, size - len);
+		if (nb > 0)
+			len += nb;
+		if (len == size)
+			size *= 2;
+	} while (nb > 0);
+	close(fd);
+
+	if (nb < 0) {
+		error("Can't read config file '%s'.", config.path);
+		free(buf);
+		return 0;
+	}
+	buf[len] = '\0';
+
+	/* at most one word every 2 chars (rounded up), plus argv[0] and NULL */
+	char **av = malloc(((len + 1) / 2 + 2) * sizeof(char*));
+	if (av == NULL) {
+		noMem();
+		free(buf);
+		return 0;
+	}
+	int ac = 0;
+	av[ac++] = prog;
+
+	char *c = buf;
+	while (*c != '\0') {
+		if (*c == '#') {
+			while (*c != '\0' && *c != '\n')
+				*c++ = ' ';
+		} else if (*c == ' ' || *c == '\t' || *c == '\n' || *c == '\r') {
+			*c++ = '\0';
+		} else {
+			av[ac++] = c;
+			while (*c != '\0' && *c != ' ' && *c != '\t' && *c != '\n' && *c != '\r' && *c != '#')
+				c++;
+		}
+	}
+	av[ac] = NULL;
+
+	*text = buf;
+	*argv = av;
+	*argc = ac;
+	return 1;
+}
+
+
+/* The options before load_config(). */
+typedef struct SavedOpts {
+	Option *option;
+	Argument *argument;
+	char *text;
+	char **argv;
+} SavedOpts;
+
+
+/* Replaces the options by those of the command line and those of the
+ * config file, which take precedence. On errors the options stay as they
+ * are, else the old ones are handed out for free_saved_opts() or
+ * restore_opts(). */
+static int load_config(SavedOpts *old) {
+
+	char *text;
+	char **argv;
+	int argc;
+	if (!read_config(&text, &argv, &argc))
+		return 0;
+
+	int argNb = settings->argNb;
+	old->option = settings->firstOption;
+	old->argument = settings->firstArgument;
+	old->text = config.text;
+	old->argv = config.argv;
+	settings->firstOption = NULL;
+	settings->firstArgument = NULL;
+	settings->argNb = 0;
+
+	optind = 0;
+	int ok = parse_opts(settings->argc, settings->argv, settings->optString);
+	if (ok) {
+		optind = 0;
+		optReplace = 1;
+		ok = parse_opts(argc, argv, settings->optString);
+		optReplace = 0;
+		if (ok && settings->argNb != argNb) {
+			error("No arguments are allowed in config file '%s'.", config.path);
+			ok = 0;
+		}
+	}
+
+	if (!ok) {
+		free_opts();
+		settings->firstOption = old->option;
+		settings->firstArgument = old->argument;
+		settings->argNb = argNb;
+		free(text);
+		free(argv);
+		return 0;
+	}
+
+	config.text = text;
+	config.argv = argv;
+	return 1;
+}
+
+
+/* The file read first is kept, controllers may point into it. */
+static void free_saved_opts(SavedOpts *old) {
+
+	free_opt_list(old->option, old->argument);
+	if (old->text != config.firstText) {
+		free(old->text);
+		free(old->argv);
+	}
+}
+
+
+static void restore_opts(SavedOpts *old) {
+
+	int argNb = settings->argNb;
+	free_opts();
+	settings->firstOption = old->option;
+	settings->firstArgument = old->argument;
+	settings->argNb = argNb;
+	free(config.text);
+	free(config.argv);
+	config.text = old->text;
+	config.argv = old->argv;
+}
+
+
+/* Adds the options of the file named by option key, if given. On SIGHUP
+ * the file is read again and reload() is called from the loop, between
+ * two events. It takes the new options with get_opt_*() and returns 0 if
+ * they are not valid, then the old ones are restored. Without the option
+ * SIGHUP ends the program as before. */
+int init_config(char key, int (*reload)()) {
+
+	if (!get_opt_str(key, 0, &config.path))
+		return 1;
+
+	SavedOpts old;
+	if (!load_config(&old))
+		return 0;
+	free_saved_opts(&old);
+
+	config.firstText = config.text;
+	config.reload = reload;
+	return 1;
+}
+
+
+static void reload_config() {
+
+	info("Reloading config file '%s'.", config.path);
+
+	SavedOpts old;
+	if (!load_config(&old)) {
+		error("Config file '%s' not taken, the settings are unchanged.", config.path);
+		return;
+	}
+	if (!config.reload()) {
+		restore_opts(&old);
+		error("Config file '%s' not taken, the settings are unchanged.", config.path);
+		return;
+	}
+	free_saved_opts(&old);
+	info("Config file '%s' reloaded.", config.path);
+}
+
+
+int stopped_by_signal() {
+	return settings->stop;
+}
+
+
+/* Sets stdout non-blocking and allocates a queue of size bytes. Until this
+ * is called - e.g. in testmode - out_write() simply writes blocking. */
+int init_output(int size, OutPolicy policy) {
+
+	if (output != NULL)
+		return 1;
+
+	output = malloc(sizeof(Output));
+	if (output == NULL) {
+		noMem();
+		return 0;
+	}
+
+	output->policy = policy;
+	output->size = size;
+	output->buf = malloc(size);
+	output->unitSize = size < OUT_UNITS_MAX ? size : OUT_UNITS_MAX;
+	output->units = malloc(output->unitSize * sizeof(int));
+	output->partial = malloc(size);
+	output->head = 0;
+	output->len = 0;
+	output->unitHead = 0;
+	output->unitNb = 0;
+	output->partialPos = 0;
+	output->partialLen = 0;
+	output->epollState = -1;
+	memset(&output->stats, 0, sizeof(OutStats));
+
+	if (output->buf == NULL || output->units == NULL || output->partial == NULL) {
+		noMem();
+		free_output();
+		return 0;
+	}
+
+	int flags = fcntl(1, F_GETFL);
+	if (flags < 0 || fcntl(1, F_SETFL, flags | O_NONBLOCK) != 0) {
+		error("Can't make stdout non-blocking.");
+		free_output();
+		return 0;
+	}
+	return 1;
+}
+
+
+/* Reads policy ('oldest', 'newest', 'coalesce', 'block') and queue size
+ * from the given options. */
+int init_output_opt(char policyKey, char sizeKey, OutPolicy dflt, int dfltSize) {
+
+	static char *names[] = { "oldest", "newest", "coalesce", "block" };
+
+	OutPolicy policy = dflt;
+	char *str;
+	if (get_opt_str(policyKey, 0, &str)) {
+		int i;
+		for (i = 0; i < 4 && strcmp(str, names[i]) != 0; i++);
+		if (i == 4) {
+			error("Value of option '-%c' is none of 'oldest', 'newest', 'coalesce', 'block'.", policyKey);
+			return 0;
+		}
+		policy = i;
+	}
+
+	int size;
+	if (!get_opt_int_between(sizeKey, 1, 2, 16*1024*1024, dfltSize, &size))
+		return 0;
+
+	return init_output(size, policy);
+}
+
+
+void free_output() {
+
+	if (output == NULL)
+		return;
+
+	OutStats *s = &output->stats;
+	if (s->queued || s->droppedOldest || s->droppedNewest || s->coalesced || s->blocked)
+		info("stdout: %lu units, %lu queued, dropped %lu oldest and %lu newest, "
+				"%lu times coalesced, %lu times blocked.", s->units, s->queued, 
+				s->droppedOldest, s->droppedNewest, s->coalesced, s->blocked);
+
+	free(output->buf);
+	free(output->units);
+	free(output->partial);
+	free(output);
+	output = NULL;
+}
+
+
+void out_get_stats(OutStats *stats) {
+
+	if (output == NULL)
+		memset(stats, 0, sizeof(OutStats));
+	else
+		*stats = output->stats;
+}
+
+
+int out_pending() {
+	return output != NULL && (output->partialLen > 0 || output->unitNb > 0);
+}
+
+
+static int write_blocking(const unsigned char *buf, int nb) {
+
+	while (nb > 0) {
+		int r = write(1, buf, nb);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN) {
+				struct pollfd pfd = {1, POLLOUT, 0};
+				poll(&pfd, 1, -1);
+				continue;
+			}
+			return 0;
+		}
+		buf += r;
+		nb -= r;
+	}
+	return 1;
+}
+
+
+static void drop_first_unit() {
+
+	int nb = output->units[output->unitHead];
+	output->head = (output->head + nb) % output->size;
+	output->len -= nb;
+	output->unitHead = (output->unitHead + 1) % output->unitSize;
+	output->unitNb--;
+}
+
+
+/* After a failed write: 1 if stdout is only busy. */
+static int check_write_error() {
+
+	if (errno == EAGAIN || errno == EINTR)
+		return 1;
+
+	error("Can't write to stdout (%s).", strerror(errno));
+	return 0;
+}
+
+
+/* Writes as much as stdout takes without blocking. Returns 0 on errors. */
+int out_flush() {
+
+	if (output == NULL)
+		return 1;
+
+	/* nothing else before the rest of a partly written unit */
+	while (output->partialLen > 0) {
+		int r = write(1, output->partial + output->partialPos, output->partialLen);
+		if (r < 0)
+			return check_write_error();
+		output->partialPos += r;
+		output->partialLen -= r;
+	}
+
+	while (output->len > 0) {
+
+		struct iovec iov[2];
+		int first = output->size - output->head;
+		if (first > output->len)
+			first = output->len;
+		iov[0].iov_base = output->buf + output->head;
+		iov[0].iov_len = first;
+		iov[1].iov_base = output->buf;
+		iov[1].iov_len = output->len - first;
+
+		int r = writev(1, iov, iov[1].iov_len > 0 ? 2 : 1);
+		if (r < 0)
+			break;
+
+		while (output->unitNb > 0 && r >= output->units[output->unitHead]) {
+			r -= output->units[output->unitHead];
+			drop_first_unit();
+		}
+
+		if (r > 0) {
+			/* the rest of a partly written unit */
+			int nb = output->units[output->unitHead] - r;
+			int i;
+			for (i = 0; i < nb; i++)
+				output->partial[i] = output->buf[(output->head + r + i) % output->size];
+			output->partialPos = 0;
+			output->partialLen = nb;
+			drop_first_unit();
+			return 1;
+		}
+	}
+
+	if (out_pending())
+		return check_write_error();
+	return 1;
+}
+
+
+/* Writes one unit - e.g. one event - to stdout or queues it. Units are
+ * only written or dropped as a whole. Returns 0 if stdout failed. */
+int out_write(const void *data, int nb) {
+
+	static int mapping = 0;
+
+	const unsigned char *buf = data;
+
+	if (nb <= 0)
+		return 1;
+
+	/* the map writes its result through out_write() again */
+	if (outMap != NULL && !mapping) {
+		mapping = 1;
+		int r = outMap(loop_owner(), buf, nb);
+		mapping = 0;
+		return r;
+	}
+
+	if (output == NULL)
+		return write_blocking(buf, nb);
+
+	OutStats *s = &output->stats;
+	s->units++;
+	s->bytes += nb;
+
+	if (!out_pending()) {
+		int r = write(1, buf, nb);
+		if (r == nb)
+			return 1;
+		if (r < 0) {
+			if (errno != EAGAIN && errno != EINTR)
+				return 0;
+			r = 0;
+		}
+		if (r > 0) {
+			/* nb - r < nb <= size, if nb was too big it is written through */
+			if (nb > output->size) {
+				s->blocked++;
+				return write_blocking(buf + r, nb - r);
+			}
+			memcpy(output->partial, buf + r, nb - r);
+			output->partialPos = 0;
+			output->partialLen = nb - r;
+			s->queued++;
+			return 1;
+		}
+	}
+
+	if (nb > output->size) {
+		if (output->policy == OUT_BLOCK) {
+			s->blocked++;
+			return write_blocking(buf, nb);
+		}
+		s->droppedNewest++;
+		return 1;
+	}
+
+	while (output->len + nb > output->size || output->unitNb == output->unitSize) {
+
+		switch (output->policy) {
+
+			case OUT_DROP_NEWEST:
+				s->droppedNewest++;
+				return 1;
+
+			case OUT_DROP_OLDEST:
+				drop_first_unit();
+				s->droppedOldest++;
+				break;
+
+			case OUT_COALESCE:
+				while (output->unitNb > 0)
+					drop_first_unit();
+				s->coalesced++;
+				break;
+
+			case OUT_BLOCK: {
+				struct pollfd pfd = {1, POLLOUT, 0};
+				s->blocked++;
+				if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+					return 0;
+				if (!out_flush())
+					return 0;
+				break;
+			}
+		}
+	}
+
+	int tail = (output->head + output->len) % output->size;
+	int first = output->size - tail;
+	if (first > nb)
+		first = nb;
+	memcpy(output->buf + tail, buf, first);
+	memcpy(output->buf, buf + first, nb - first);
+	output->len += nb;
+	output->units[(output->unitHead + output->unitNb) % output->unitSize] = nb;
+	output->unitNb++;
+	s->queued++;
+
+	return 1;
+}
+
+
+/* Lets map rewrite every unit before it is written, e.g. to merge the
+ * outputs of several controllers in one process. */
+void out_set_map(int (*map)(int owner, const unsigned char *buf, int nb)) {
+	outMap = map;
+}
+
+
+/* Calls cb whenever stdout took the last queued unit, e.g. to write what
+ * was held back while it was busy. One callback per process. */
+void out_on_idle(LoopCb cb, void *data) {
+	outIdleCb = cb;
+	outIdleData = data;
+	outIdleOwner = loop != NULL ? loop->owner : 0;
+}
+
+
+static int out_idle() {
+
+	if (outIdleCb == NULL || out_pending())
+		return 1;
+
+	loop->owner = outIdleOwner;
+	return outIdleCb(outIdleData);
+}
+
+
+static Source * new_source(int type, int fd, void *data) {
+
+	int i;
+	for (i = 0; i < LOOP_SOURCE_MAX && loop->source[i].type != SOURCE_FREE; i++);
+	if (i == LOOP_SOURCE_MAX) {
+		error("More than %d sources in the event loop.", LOOP_SOURCE_MAX);
+		return NULL;
+	}
+
+	Source *s = &loop->source[i];
+	s->type = type;
+	s->owner = loop->owner;
+	s->fd = fd;
+	s->fdCb = NULL;
+	s->timerCb = NULL;
+	s->data = data;
+	return s;
+}
+
+
+static Source * find_source(int type, int fd) {
+
+	int i;
+	for (i = 0; i < LOOP_SOURCE_MAX; i++)
+		if (loop->source[i].type == type && loop->source[i].fd == fd)
+			return &loop->source[i];
+	return NULL;
+}
+
+
+static int ctl_source(int op, Source *s, uint32_t events) {
+
+	struct epoll_event ev;
+	ev.events = events;
+	ev.data.ptr = s;
+	return epoll_ctl(loop->epollFd, op, s->fd, &ev) == 0;
+}
+
+
+/* Waits for EPOLLOUT on stdout only while something is queued. */
+static int watch_output() {
+
+	if (output == NULL || output->epollState == 2)
+		return 1;
+
+	int want = out_pending() ? 1 : 0;
+	if (want == output->epollState)
+		return 1;
+
+	uint32_t events = want ? EPOLLOUT : 0;
+
+	if (output->epollState < 0) {
+		Source *s = new_source(SOURCE_STDOUT, 1, NULL);
+		if (s == NULL)
+			return 0;
+		if (!ctl_source(EPOLL_CTL_ADD, s, events)) {
+			int err = errno;
+			s->type = SOURCE_FREE;
+			if (err == EPERM) {
+				/* a regular file, never blocks */
+				output->epollState = 2;
+				return 1;
+			}
+			error("Can't add stdout to the event loop: %s.", strerror(err));
+			return 0;
+		}
+	} else if (!ctl_source(EPOLL_CTL_MOD, find_source(SOURCE_STDOUT, 1), events)) {
+		int err = errno;
+		error("Can't watch stdout: %s.", strerror(err));
+		return 0;
+	}
+	output->epollState = want;
+	return 1;
+}
+
+
+/* Blocks the signals that end the program and takes them in through a
+ * signalfd, so they are handled in the loop like any other event. */
+int loop_init() {
+
+	if (loop != NULL)
+		return 1;
+
+	loop = malloc(sizeof(Loop));
+	if (loop == NULL) {
+		noMem();
+		return 0;
+	}
+	memset(loop, 0, sizeof(Loop));
+	loop->statEvents = stat_counter("loop events");
+	loop->statCallback = stat_histogram("loop callback");
+	loop->statJitter = stat_histogram("timer jitter");
+
+	sigset_t sigs;
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGHUP);
+	sigaddset(&sigs, SIGTERM);
+	sigaddset(&sigs, SIGPIPE);
+	sigaddset(&sigs, SIGUSR1);
+	if (settings != NULL && settings->testmode) {
+		sigaddset(&sigs, SIGINT);
+		sigaddset(&sigs, SIGQUIT);
+	}
+	sigprocmask(SIG_BLOCK, &sigs, NULL);
+
+	loop->epollFd = epoll_create1(EPOLL_CLOEXEC);
+	int sigFd = signalfd(-1, &sigs, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (loop->epollFd < 0 || sigFd < 0) {
+		int err = errno;
+		error("Can't set up event loop: %s.", strerror(err));
+		if (sigFd >= 0)
+			close(sigFd);
+		loop_free();
+		return 0;
+	}
+
+	Source *s = new_source(SOURCE_SIGNAL, sigFd, NULL);
+	if (!ctl_source(EPOLL_CTL_ADD, s, EPOLLIN)) {
+		int err = errno;
+		error("Can't add signalfd to the event loop: %s.", strerror(err));
+		close(sigFd);
+		s->type = SOURCE_FREE;
+		loop_free();
+		return 0;
+	}
+	return 1;
+}
+
+
+/* Closes the timers and the signalfd, the fds of loop_add_fd() are left
+ * to their owners. */
+void loop_free() {
+
+	if (loop == NULL)
+		return;
+
+	int i;
+	for (i = 0; i < LOOP_SOURCE_MAX; i++) {
+		Source *s = &loop->source[i];
+		if (s->type == SOURCE_TIMER || s->type == SOURCE_SIGNAL)
+			close(s->fd);
+	}
+	if (loop->epollFd >= 0)
+		close(loop->epollFd);
+
+	free(loop);
+	loop = NULL;
+}
+
+
+/* Returns 0 on errors. errno is EPERM without a message if the fd can't
+ * be polled, e.g. a regular file. */
+int loop_add_fd(int fd, uint32_t events, LoopFdCb cb, void *data) {
+
+	Source *s = new_source(SOURCE_FD, fd, data);
+	if (s == NULL)
+		return 0;
+	s->fdCb = cb;
+
+	if (!ctl_source(EPOLL_CTL_ADD, s, events)) {
+		int err = errno;
+		s->type = SOURCE_FREE;
+		if (err != EPERM)
+			error("Can't add fd %d to the event loop: %s.", fd, strerror(err));
+		errno = err;
+		return 0;
+	}
+	return 1;
+}
+
+
+int loop_mod_fd(int fd, uint32_t events) {
+
+	Source *s = find_source(SOURCE_FD, fd);
+	if (s == NULL || !ctl_source(EPOLL_CTL_MOD, s, events)) {
+		error("Can't change the events of fd %d.", fd);
+		return 0;
+	}
+	return 1;
+}
+
+
+void loop_del_fd(int fd) {
+
+	if (loop == NULL)
+		return;
+	Source *s = find_source(SOURCE_FD, fd);
+	if (s == NULL)
+		return;
+	epoll_ctl(loop->epollFd, EPOLL_CTL_DEL, fd, NULL);
+	s->type = SOURCE_CLOSED;
+}
+
+
+/* Creates a stopped CLOCK_MONOTONIC timer. Returns the timer or -1. */
+int loop_add_timer(LoopTimerCb cb, void *data) {
+
+	int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (fd < 0) {
+		int err = errno;
+		error("Can't create timer: %s.", strerror(err));
+		return -1;
+	}
+
+	Source *s = new_source(SOURCE_TIMER, fd, data);
+	if (s == NULL) {
+		close(fd);
+		return -1;
+	}
+	s->timerCb = cb;
+
+	if (!ctl_source(EPOLL_CTL_ADD, s, EPOLLIN)) {
+		int err = errno;
+		error("Can't add timer to the event loop: %s.", strerror(err));
+		s->type = SOURCE_FREE;
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+
+static void set_timer_interval(int timer, int intervalMs) {
+
+	Source *s = find_source(SOURCE_TIMER, timer);
+	if (s != NULL) {
+		s->intervalMs = intervalMs;
+		s->lastExp.tv_sec = 0;
+		s->lastExp.tv_nsec = 0;
+	}
+}
+
+
+static long us_between(const struct timespec *from, const struct timespec *to) {
+	return (to->tv_sec - from->tv_sec) * 1000000L + (to->tv_nsec - from->tv_nsec) / 1000;
+}
+
+
+static void ms_to_timespec(int ms, struct timespec *t) {
+	t->tv_sec = ms / 1000;
+	t->tv_nsec = (ms % 1000) * 1000000L;
+}
+
+
+/* Expires firstMs from now and then every intervalMs (0: once). firstMs 0
+ * stops the timer. */
+int loop_set_timer(int timer, int firstMs, int intervalMs) {
+
+	set_timer_interval(timer, intervalMs);
+	struct itimerspec its;
+	ms_to_timespec(firstMs, &its.it_value);
+	ms_to_timespec(intervalMs, &its.it_interval);
+
+	if (timerfd_settime(timer, 0, &its, NULL) != 0) {
+		int err = errno;
+		error("Can't set timer: %s.", strerror(err));
+		return 0;
+	}
+	return 1;
+}
+
+
+/* Expires at the CLOCK_MONOTONIC time at and then every intervalMs. */
+int loop_set_timer_at(int timer, const struct timespec *at, int intervalMs) {
+
+	set_timer_interval(timer, intervalMs);
+	struct itimerspec its;
+	its.it_value = *at;
+	ms_to_timespec(intervalMs, &its.it_interval);
+
+	if (timerfd_settime(timer, TFD_TIMER_ABSTIME, &its, NULL) != 0) {
+		int err = errno;
+		error("Can't set timer: %s.", strerror(err));
+		return 0;
+	}
+	return 1;
+}
+
+
+/* Gets the next expiration as CLOCK_MONOTONIC time. Returns 0 if the timer
+ * is stopped or on errors. */
+int loop_get_timer(int timer, struct timespec *at) {
+
+	struct itimerspec its;
+	if (timerfd_gettime(timer, &its) != 0)
+		return 0;
+	if (its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0)
+		return 0;
+
+	clock_gettime(CLOCK_MONOTONIC, at);
+	at->tv_sec += its.it_value.tv_sec;
+	at->tv_nsec += its.it_value.tv_nsec;
+	if (at->tv_nsec >= 1000000000L) {
+		at->tv_sec++;
+		at->tv_nsec -= 1000000000L;
+	}
+	return 1;
+}
+
+
+void loop_del_timer(int timer) {
+
+	if (loop == NULL)
+		return;
+	Source *s = find_source(SOURCE_TIMER, timer);
+	if (s == NULL)
+		return;
+	epoll_ctl(loop->epollFd, EPOLL_CTL_DEL, timer, NULL);
+	close(timer);
+	s->type = SOURCE_CLOSED;
+}
+
+
+/* Calls cb once after the callbacks of the current round. */
+int loop_defer(LoopCb cb, void *data) {
+
+	if (loop->deferredNb == LOOP_DEFER_MAX) {
+		error("More than %d deferred callbacks.", LOOP_DEFER_MAX);
+		return 0;
+	}
+	loop->deferred[loop->deferredNb].cb = cb;
+	loop->deferred[loop->deferredNb].data = data;
+	loop->deferred[loop->deferredNb].owner = loop->owner;
+	loop->deferredNb++;
+	return 1;
+}
+
+
+void loop_stop() {
+	loop->stop = 1;
+}
+
+
+/* Sources and deferred callbacks added from now on belong to owner - e.g.
+ * the controller that adds them - and loop_owner() returns it while their
+ * callbacks run. */
+void loop_set_owner(int owner) {
+	if (loop != NULL)
+		loop->owner = owner;
+}
+
+
+int loop_owner() {
+	return loop != NULL ? loop->owner : 0;
+}
+
+
+static int handle_signal(Source *s) {
+
+	struct signalfd_siginfo si;
+	if (read(s->fd, &si, sizeof(si)) != sizeof(si))
+		return 1;
+
+	if (si.ssi_signo == SIGUSR1) {
+		stat_dump();
+		return 1;
+	}
+
+	if (si.ssi_signo == SIGHUP && config.reload != NULL) {
+		reload_config();
+		return 1;
+	}
+
+	info("Signal %d (%s) caught.", si.ssi_signo, strsignal(si.ssi_signo));
+	settings->stop = 1;
+	loop->stop = 1;
+	if (externalSignalHandler) 
+		externalSignalHandler(si.ssi_signo);
+	return 1;
+}
+
+
+static int dispatch(Source *s, uint32_t events) {
+
+	uint64_t exp;
+
+	switch (s->type) {
+
+		case SOURCE_FD:
+			return s->fdCb(s->fd, events, s->data);
+
+		case SOURCE_TIMER:
+			/* nothing to read if the timer was set again meanwhile */
+			if (read(s->fd, &exp, sizeof(exp)) != sizeof(exp))
+				return 1;
+			if (s->intervalMs > 0) {
+				/* deviation of the period, a missed period doesn't count */
+				struct timespec now;
+				clock_gettime(CLOCK_MONOTONIC, &now);
+				if (s->lastExp.tv_sec != 0 && exp == 1) {
+					long d = us_between(&s->lastExp, &now) - s->intervalMs * 1000L;
+					stat_record(loop->statJitter, d < 0 ? -d : d);
+				}
+				s->lastExp = now;
+			}
+			return s->timerCb(s->fd, exp, s->data);
+
+		case SOURCE_SIGNAL:
+			return handle_signal(s);
+
+		case SOURCE_STDOUT:
+			return out_flush() && out_idle();
+	}
+	return 1;
+}
+
+
+static int run_rounds() {
+
+	struct epoll_event evs[LOOP_EVENT_MAX];
+
+	loop->stop = 0;
+
+	while (!loop->stop) {
+
+		if (!watch_output())
+			return 0;
+
+		int nb = epoll_wait(loop->epollFd, evs, LOOP_EVENT_MAX, log_timeout());
+		if (nb < 0) {
+			int err = errno;
+			if (err == EINTR)
+				continue;
+			error("epoll_wait() failed: %s.", strerror(err));
+			return 0;
+		}
+
+		struct timespec t0, t1;
+		int i;
+		for (i = 0; i < nb && !loop->stop; i++) {
+			Source *s = evs[i].data.ptr;
+			loop->owner = s->owner;
+			clock_gettime(CLOCK_MONOTONIC, &t0);
+			if (!dispatch(s, evs[i].events))
+				return 0;
+			clock_gettime(CLOCK_MONOTONIC, &t1);
+			stat_record(loop->statCallback, us_between(&t0, &t1));
+		}
+		stat_add(loop->statEvents, nb);
+		log_timeout();
+
+		/* deferred callbacks may defer further ones */
+		for (i = 0; i < loop->deferredNb; i++) {
+			loop->owner = loop->deferred[i].owner;
+			clock_gettime(CLOCK_MONOTONIC, &t0);
+			if (!loop->deferred[i].cb(loop->deferred[i].data))
+				return 0;
+			clock_gettime(CLOCK_MONOTONIC, &t1);
+			stat_record(loop->statCallback, us_between(&t0, &t1));
+		}
+		loop->deferredNb = 0;
+		loop->owner = 0;
+
+		for (i = 0; i < LOOP_SOURCE_MAX; i++)
+			if (loop->source[i].type == SOURCE_CLOSED)
+				loop->source[i].type = SOURCE_FREE;
+
+		trace_flush();
+		cap_flush();
+		log_flush();
+	}
+	return 1;
+}
+
+
+/* Runs until loop_stop() or a signal (returns 1) or until a callback
+ * fails (returns 0). */
+int loop_run() {
+
+	loop->running = 1;
+	int res = run_rounds();
+	loop->running = 0;
+	log_repeated();
+	log_suppressed();
+	trace_flush();
+	cap_flush();
+	log_flush();
+	return res;
+}
+
+
+static int add_stat(const char *name, int histogram) {
+
+	int i;
+	for (i = 0; i < statNb; i++)
+		if (strcmp(stats[i].name, name) == 0)
+			return i;
+
+	if (statNb == STAT_MAX) {
+		error("More than %d statistics, '%s' is not counted.", STAT_MAX, name);
+		return -1;
+	}
+	memset(&stats[statNb], 0, sizeof(Stat));
+	stats[statNb].name = name;
+	stats[statNb].histogram = histogram;
+	return statNb++;
+}
+
+
+/* Returns the id of the counter, the same for the same name, or -1. */
+int stat_counter(const char *name) {
+	return add_stat(name, 0);
+}
+
+
+int stat_histogram(const char *name) {
+	return add_stat(name, 1);
+}
+
+
+void stat_add(int id, unsigned long n) {
+	if (id >= 0)
+		stats[id].count += n;
+}
+
+
+/* Bucket i counts values below 2^i us, the last one all larger values. */
+void stat_record(int id, unsigned long us) {
+
+	if (id < 0)
+		return;
+
+	Stat *s = &stats[id];
+	int b = us == 0 ? 0 : 8 * sizeof(long) - __builtin_clzl(us);
+	if (b >= STAT_BUCKETS)
+		b = STAT_BUCKETS - 1;
+
+	s->bucket[b]++;
+	s->count++;
+	s->sum += us;
+	if (us > s->max)
+		s->max = us;
+}
+
+
+/* Logs all statistics and those of the output stage, without rate limit. */
+void stat_dump() {
+
+	log_line("Statistics:");
+
+	int i, b;
+	for (i = 0; i < statNb; i++) {
+		Stat *s = &stats[i];
+		if (!s->histogram) {
+			log_line("  %s: %lu", s->name, s->count);
+			continue;
+		}
+		if (s->count == 0) {
+			log_line("  %s: none", s->name);
+			continue;
+		}
+
+		char line[STAT_BUCKETS * 24];
+		int len = 0;
+		for (b = 0; b < STAT_BUCKETS; b++) 
+			if (s->bucket[b] > 0)
+				len += snprintf(line + len, sizeof(line) - len, " %s%lu:%lu",
+						b < STAT_BUCKETS - 1 ? "<" : ">=", 
+						b < STAT_BUCKETS - 1 ? 1UL << b : 1UL << (b - 1), s->bucket[b]);
+
+		log_line("  %s: %lu, avg %lu us, max %lu us |%s", s->name, s->count, 
+				s->sum / s->count, s->max, line);
+	}
+
+	if (output != NULL) {
+		OutStats *o = &output->stats;
+		log_line("  stdout: %lu units, %lu bytes, %lu queued, dropped %lu oldest and %lu newest, "
+				"%lu times coalesced, %lu times blocked", o->units, o->bytes, o->queued, 
+				o->droppedOldest, o->droppedNewest, o->coalesced, o->blocked);
+	}
+}
+
+
+/* unitNb is rounded up to a power of 2. Returns NULL on errors. */
+Ring * ring_new(int unitSize, int unitNb) {
+
+	if (unitSize <= 0 || unitNb <= 0) {
+		error("Invalid ring of %d units of %d bytes.", unitNb, unitSize);
+		return NULL;
+	}
+
+	Ring *ring;
+	if (posix_memalign((void **)&ring, CACHE_LINE, sizeof(Ring)) != 0) {
+		noMem();
+		return NULL;
+	}
+	memset(ring, 0, sizeof(Ring));
+
+	unsigned long nb = 1;
+	while (nb < (unsigned long)unitNb)
+		nb <<= 1;
+	ring->mask = nb - 1;
+	ring->unitSize = unitSize;
+
+	ring->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (ring->fd < 0) {
+		int err = errno;
+		error("Can't create eventfd: %s.", strerror(err));
+		free(ring);
+		return NULL;
+	}
+
+	if (posix_memalign((void **)&ring->buf, CACHE_LINE, nb * unitSize) != 0) {
+		noMem();
+		close(ring->fd);
+		free(ring);
+		return NULL;
+	}
+	return ring;
+}
+
+
+void ring_free(Ring *ring) {
+
+	if (ring == NULL)
+		return;
+	close(ring->fd);
+	free(ring->buf);
+	free(ring);
+}
+
+
+/* Producer side. Returns 0 if the ring is full. */
+int ring_put(Ring *ring, const void *unit) {
+
+	unsigned long tail = ring->tail;
+
+	if (tail - ring->headCopy > ring->mask) {
+		ring->headCopy = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		if (tail - ring->headCopy > ring->mask)
+			return 0;
+	}
+	memcpy(ring->buf + (tail & ring->mask) * ring->unitSize, unit, ring->unitSize);
+	__atomic_store_n(&ring->tail, tail + 1, __ATOMIC_SEQ_CST);
+
+	/* The consumer may have found the ring empty and be waiting. Either
+	 * it sees the new tail or this sees its head - both are seq_cst. */
+	if (__atomic_load_n(&ring->head, __ATOMIC_SEQ_CST) == tail) {
+		uint64_t one = 1;
+		if (write(ring->fd, &one, sizeof(one)) != sizeof(one))
+			return 1;  /* the counter is already set */
+	}
+	return 1;
+}
+
+
+/* Consumer side. Returns 0 if the ring is empty. */
+int ring_get(Ring *ring, void *unit) {
+
+	unsigned long head = ring->head;
+
+	if (head == ring->tailCopy) {
+		ring->tailCopy = __atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST);
+		if (head == ring->tailCopy) {
+			/* clear the wakeup only when empty, then look once more */
+			uint64_t cnt;
+			if (read(ring->fd, &cnt, sizeof(cnt)) == sizeof(cnt))
+				ring->tailCopy = __atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST);
+			if (head == ring->tailCopy)
+				return 0;
+		}
+	}
+	memcpy(unit, ring->buf + (head & ring->mask) * ring->unitSize, ring->unitSize);
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_SEQ_CST);
+	return 1;
+}
+
+
+int ring_fd(Ring *ring) {
+	return ring->fd;
+}
+
+
+static int cap_header_ok(const CapHeader *h) {
+	return	memcmp(h->magic, CAP_MAGIC, sizeof(h->magic)) == 0
+		&&	h->version == CAP_VERSION && h->recordSize == sizeof(CapRecord);
+}
+
+
+/* Appends to the file at path, which is created if it doesn't exist. */
+int cap_open(const char *path) {
+
+	if (capture.fd >= 0) {
+		error("Only one capture file per process, '%s' isn't used.", path);
+		return 0;
+	}
+
+	int fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		int err = errno;
+		error("Can't open capture file '%s': %s.", path, strerror(err));
+		return 0;
+	}
+
+	CapHeader h;
+	int nb = read(fd, &h, sizeof(h));
+	if (nb == 0) {
+		memset(&h, 0, sizeof(h));
+		memcpy(h.magic, CAP_MAGIC, sizeof(h.magic));
+		h.version = CAP_VERSION;
+		h.recordSize = sizeof(CapRecord);
+		nb = write(fd, &h, sizeof(h));
+		if (nb != sizeof(h)) {
+			int err = nb < 0 ? errno : ENOSPC;
+			error("Can't write capture file '%s': %s.", path, strerror(err));
+			close(fd);
+			return 0;
+		}
+	} else if (nb != sizeof(h) || !cap_header_ok(&h) || lseek(fd, 0, SEEK_END) % 8 != 0) {
+		error("'%s' is no capture file of this version or is damaged.", path);
+		close(fd);
+		return 0;
+	}
+
+	capture.fd = fd;
+	capture.len = 0;
+	cap_write(CAP_START, NULL, 0);
+	return 1;
+}
+
+
+static void cap_flush() {
+
+	int pos = 0;
+	while (capture.fd >= 0 && pos < capture.len) {
+		int nb = write(capture.fd, capture.buf + pos, capture.len - pos);
+		if (nb > 0) {
+			pos += nb;
+		} else if (nb < 0 && errno != EINTR) {
+			int err = errno;
+			error("Can't write capture file: %s. Capture stopped.", strerror(err));
+			close(capture.fd);
+			capture.fd = -1;
+		}
+	}
+	capture.len = 0;
+}
+
+
+/* Appends a record of nb <= CAP_DATA_MAX bytes, if a capture is open. */
+void cap_write(int type, const void *buf, int nb) {
+
+	if (capture.fd < 0)
+		return;
+
+	int size = sizeof(CapRecord) + ((nb + 7) & ~7);
+	if (CAP_BUF - capture.len < size)
+		cap_flush();
+
+	CapRecord *r = (CapRecord *)(capture.buf + capture.len);
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	r->ns = now.tv_sec * 1000000000ULL + now.tv_nsec;
+	r->type = type;
+	r->len = nb;
+	r->owner = loop_owner();
+	memcpy(r + 1, buf, nb);
+	memset((unsigned char *)(r + 1) + nb, 0, size - sizeof(CapRecord) - nb);
+	capture.len += size;
+
+	if (loop == NULL || !loop->running)
+		cap_flush();
+}
+
+
+int cap_active() {
+	return capture.fd >= 0;
+}
+
+
+/* After the last record: waits until stdout took everything. */
+static int replay_end(int timer) {
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	if (out_pending()) {
+		struct timespec at = now;
+		at.tv_nsec += CAP_DRAIN_MS * 1000000L;
+		if (at.tv_nsec >= 1000000000L) {
+			at.tv_sec++;
+			at.tv_nsec -= 1000000000L;
+		}
+		return loop_set_timer_at(timer, &at, 0);
+	}
+
+	double s = us_between(&replay.began, &now) / 1e6;
+	info("Replayed %lu records in %.3f s (%.0f records/s).", replay.records, s, 
+			s > 0 ? replay.records / s : 0.);
+	loop_stop();
+	return 1;
+}
+
+
+static int replay_next(int timer, uint64_t exp, void *data) {
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	int batch = 0;
+
+	while (replay.pos < replay.size) {
+
+		CapRecord *r = (CapRecord *)(replay.map + replay.pos);
+		/* r->len only once the header is in the file */
+		size_t size = sizeof(CapRecord);
+		if (replay.size - replay.pos >= size)
+			size += (r->len + 7) & ~7;
+		if (replay.size - replay.pos < size) {
+			info("The capture file ends with an incomplete record.");
+			break;
+		}
+
+		if (r->type == CAP_START) {
+			replay.baseNs = r->ns;
+			replay.start = now;
+		} else if (replay.speed > 0) {
+			uint64_t ns = (r->ns - replay.baseNs) / replay.speed + replay.start.tv_nsec;
+			struct timespec at = { replay.start.tv_sec + ns / 1000000000ULL, ns % 1000000000ULL };
+			if (at.tv_sec > now.tv_sec || (at.tv_sec == now.tv_sec && at.tv_nsec > now.tv_nsec))
+				return loop_set_timer_at(timer, &at, 0);
+		} else if (batch == CAP_BATCH) {
+			/* lets the loop write stdout between batches */
+			return loop_set_timer_at(timer, &now, 0);
+		}
+
+		replay.pos += size;
+		if (r->type != CAP_START) {
+			struct timespec recorded = { r->ns / 1000000000ULL, r->ns % 1000000000ULL };
+			replay.records++;
+			batch++;
+			if (!replay.cb(r->type, (const unsigned char *)(r + 1), r->len, &recorded, replay.data))
+				return 0;
+		}
+	}
+
+	replay.pos = replay.size;
+	return replay_end(timer);
+}
+
+
+/* Maps the file at path and starts to feed its records to cb. */
+int cap_replay(const char *path, int speed, CapCb cb, void *data) {
+
+	if (replay.map != NULL) {
+		error("Only one replay per process, '%s' isn't replayed.", path);
+		return 0;
+	}
+
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st) != 0) {
+		int err = errno;
+		error("Can't open capture file '%s': %s.", path, strerror(err));
+		if (fd >= 0)
+			close(fd);
+		return 0;
+	}
+
+	if (st.st_size < 0 || (size_t)st.st_size < sizeof(CapHeader)) {
+		error("'%s' is no capture file.", path);
+		close(fd);
+		return 0;
+	}
+
+	replay.map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (replay.map == MAP_FAILED) {
+		int err = errno;
+		replay.map = NULL;
+		error("Can't map capture file '%s': %s.", path, strerror(err));
+		return 0;
+	}
+	replay.size = (size_t)st.st_size;
+
+	if (!cap_header_ok((CapHeader *)replay.map)) {
+		error("'%s' is no capture file of this version.", path);
+		return 0;
+	}
+	replay.pos = sizeof(CapHeader);
+	replay.speed = speed;
+	replay.cb = cb;
+	replay.data = data;
+	replay.records = 0;
+	replay.baseNs = 0;
+	clock_gettime(CLOCK_MONOTONIC, &replay.began);
+	replay.start = replay.began;
+
+	replay.timer = loop_add_timer(replay_next, NULL);
+	return replay.timer >= 0 && loop_set_timer_at(replay.timer, &replay.began, 0);
+}
+
+
+void cap_close() {
+
+	if (capture.fd >= 0) {
+		cap_flush();
+		close(capture.fd);
+		capture.fd = -1;
+	}
+
+	if (replay.map != NULL) {
+		munmap(replay.map, replay.size);
+		replay.map = NULL;
+	}
 }
@@ -22,6 +22,10 @@
 #ifndef _UTIL_H_
 #define _UTIL_H_
 
+#include <stdint.h>
+#include <time.h>
+#include <sys/epoll.h>
+
 #define info(args...)  msg(args)
 #define error(args...) msg("ERROR: " args) 
 #define noMem() msg("ERROR: Couldn't allocate new memory. (%s:%d)",__FILE__, __LINE__)
@@ -35,14 +39,127 @@ int get_opt_str(char key, int withErrorMsg, char **strAddr);
 int get_opt_int(char key, int withErrorMsg, int *intAddr);
 int get_opt_int_default(char key, int withErrorMsg, int dflt, int *intAddr);
 int get_opt_int_between(char key, int withErrorMsg, int from, int to, int dflt, int *intAddr);
+int get_opt_int_list(char key, int withErrorMsg, int from, int to, int dflt, int nb, int *ints);
 
 int get_args(char ***args);
+int push_opts(char *optString, int argc, char *argv[]);
+void pop_opts();
+int init_config(char key, int (*reload)());
 
 char * make_str(const char *format, ...) __attribute__ ((format(__printf__, 1, 2)));
+int split_str(const char *str, char sep, char ***items);
 int str_to_int(char *str, int * intAddr);
-char * get_bin_str(unsigned char byte);
-char * get_multi_base_str(unsigned char byte);
+
+/* formatting of bytes into buffers of the caller, returns the buffer */
+#define BIN_STR_LEN 9
+#define MULTI_BASE_STR_LEN 64
+
+char * get_bin_str(unsigned char byte, char *buf);
+char * get_multi_base_str(unsigned char byte, char *buf);
+
+/* testmode output: lines are collected and written to stdout at the end
+ * of a round of the event loop, or right away while it doesn't run */
+#define TRACE_LINE_LEN 512  /* longest line that is never cut */
+
+void trace(const char *format, ...) __attribute__ ((format(__printf__, 1, 2)));
+void trace_flush();
 
 int stopped_by_signal();
 
+/* event loop: epoll with fd sources, timers, signals and deferred callbacks.
+ * Callbacks return 0 on errors, which ends loop_run(). */
+
+typedef int (*LoopFdCb)(int fd, uint32_t events, void *data);
+typedef int (*LoopTimerCb)(int timer, uint64_t expirations, void *data);
+typedef int (*LoopCb)(void *data);
+
+int loop_init();
+void loop_free();
+int loop_add_fd(int fd, uint32_t events, LoopFdCb cb, void *data);
+int loop_mod_fd(int fd, uint32_t events);
+void loop_del_fd(int fd);
+int loop_add_timer(LoopTimerCb cb, void *data);
+int loop_set_timer(int timer, int firstMs, int intervalMs);
+int loop_set_timer_at(int timer, const struct timespec *at, int intervalMs);
+int loop_get_timer(int timer, struct timespec *at);
+void loop_del_timer(int timer);
+int loop_defer(LoopCb cb, void *data);
+int loop_run();
+void loop_stop();
+void loop_set_owner(int owner);
+int loop_owner();
+
+/* output stage: non-blocking stdout with a bounded queue */
+
+typedef enum { 
+	OUT_DROP_OLDEST,    /* drop queued units to make room */
+	OUT_DROP_NEWEST,    /* drop the unit that doesn't fit */
+	OUT_COALESCE,       /* drop all queued units, keep the latest state */
+	OUT_BLOCK           /* wait until stdout takes enough */
+} OutPolicy;
+
+typedef struct OutStats {
+	unsigned long units;
+	unsigned long bytes;
+	unsigned long queued;         /* units that had to wait in the queue */
+	unsigned long droppedOldest;  /* units */
+	unsigned long droppedNewest;  /* units */
+	unsigned long coalesced;      /* times the queue was coalesced */
+	unsigned long blocked;        /* times the process waited for stdout */
+} OutStats;
+
+int init_output(int size, OutPolicy policy);
+int init_output_opt(char policyKey, char sizeKey, OutPolicy dflt, int dfltSize);
+void free_output();
+int out_write(const void *buf, int nb);
+int out_flush();
+int out_pending();
+void out_get_stats(OutStats *stats);
+void out_set_map(int (*map)(int owner, const unsigned char *buf, int nb));
+void out_on_idle(LoopCb cb, void *data);
+
+/* runtime statistics: named counters and histograms (microseconds in
+ * power of 2 buckets), logged on SIGUSR1. Ids < 0 are ignored, so a failed
+ * registration doesn't need to be checked on the hot path. */
+
+#define STAT_MAX 32
+#define STAT_BUCKETS 16
+
+int stat_counter(const char *name);
+int stat_histogram(const char *name);
+void stat_add(int id, unsigned long n);
+void stat_record(int id, unsigned long us);
+void stat_dump();
+
+/* lock-free ring of fixed size units between one producer thread and one
+ * consumer thread. The consumer is woken up through the eventfd of
+ * ring_fd() and has to take all units, until ring_get() returns 0. */
+
+typedef struct Ring Ring;
+
+Ring * ring_new(int unitSize, int unitNb);
+void ring_free(Ring *ring);
+int ring_put(Ring *ring, const void *unit);
+int ring_get(Ring *ring, void *unit);
+int ring_fd(Ring *ring);
+
+/* capture of raw inputs to an append-only file of records with their
+ * CLOCK_MONOTONIC time, and replay of such a file through the loop: at
+ * the recorded times divided by speed, or as fast as possible if speed
+ * is 0. The types of records are up to the controller, CAP_START is
+ * written by cap_open(). A failed write ends the capture, not the program.
+ * The replay passes the recorded time of a record to the callback and
+ * stops the loop after the last record. */
+
+#define CAP_START 0
+#define CAP_DATA_MAX 4096   /* longest record */
+
+typedef int (*CapCb)(int type, const unsigned char *buf, int nb, const struct timespec *at, void *data);
+
+int cap_open(const char *path);
+void cap_write(int type, const void *buf, int nb);
+int cap_active();
+int cap_replay(const char *path, int speed, CapCb cb, void *data);
+void cap_close();
+
 #endif